@@ -0,0 +1,139 @@
+/*
+ * Ping latency benchmark of the server
+ *
+ * Build: g++ -std=c++17 -O2 -o bench_latency bench_latency.cpp common.cpp
+ * Usage: ./bench_latency <ip_addr> <port> <gap_us> <num_msgs>
+ *
+ * Registers two users, sends num_msgs messages from one to the other with gap_us microseconds between them, and
+ * prints the percentiles of the time from sending a message to receiving it. A long gap lets the event loop of the
+ * server go idle between messages, which is where the low-latency mode makes a difference.
+ */
+
+#include "common.h"
+#include "frame.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Acknowledge as often as the client does
+#define ACK_BATCH       64
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Blocking socket, so that the time is spent in the server rather than in polling
+int socket_connect(const char* ip_addr, int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, ip_addr, &addr.sin_addr);
+    addr.sin_port = htons(port);
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("[FATAL] connect()");
+        exit(1);
+    }
+
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    return sockfd;
+}
+
+void flush(int sockfd, BlockBuffer* buf_out) {
+    while (!buf_out->empty()) {
+        if (buf_out->output_to_fd(sockfd) < 0) {
+            perror("[FATAL] write()");
+            exit(1);
+        }
+    }
+}
+
+// Read a whole frame and return its request type
+int read_frame(int sockfd, Buffer* buf) {
+    bool closed = false;
+    buf->reset(sizeof(size_t));
+    while (!handle_read_common(sockfd, buf, &closed)) {
+        if (closed) {
+            fprintf(stderr, "[FATAL] The server has closed the connection\n");
+            exit(1);
+        }
+    }
+    buf->inc_rpos(sizeof(size_t));
+    return *buf->read<int>();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 5) {
+        printf("Usage: ./bench_latency <ip_addr> <port> <gap_us> <num_msgs>\n");
+        return 1;
+    }
+    int port = atoi(argv[2]);
+    long gap_ns = atol(argv[3]) * 1000L;
+    int num_msgs = atoi(argv[4]);
+    if (num_msgs <= 0) {
+        printf("num_msgs should be positive\n");
+        return 1;
+    }
+
+    int senderfd = socket_connect(argv[1], port);
+    int recverfd = socket_connect(argv[1], port);
+
+    Buffer buf(sizeof(size_t));
+    BlockBuffer buf_out;
+
+    // Unique names so that the delivery windows of previous runs are not retransmitted
+    std::string sender = "bench-sender-" + std::to_string(getpid());
+    std::string recver = "bench-recver-" + std::to_string(getpid());
+    CSRegister::encode(&buf_out, sender);
+    flush(senderfd, &buf_out);
+    read_frame(senderfd, &buf);
+    CSRegister::encode(&buf_out, recver);
+    flush(recverfd, &buf_out);
+    read_frame(recverfd, &buf);
+
+    std::vector<long> latencies;
+    latencies.reserve(num_msgs);
+    for (int i = 0; i < num_msgs; ++i) {
+        long start = now_ns();
+        CSSendMsg::encode(&buf_out, recver, std::string("ping"));
+        flush(senderfd, &buf_out);
+
+        if (read_frame(recverfd, &buf) != REQ_SC_NEW_MSG) {
+            fprintf(stderr, "[FATAL] Unexpected frame\n");
+            return 1;
+        }
+        auto [seq, from, msg] = SCNewMsg::decode(&buf);
+        latencies.push_back(now_ns() - start);
+
+        if (seq % ACK_BATCH == 0) {
+            CSAck::encode(&buf_out, seq);
+            flush(recverfd, &buf_out);
+        }
+
+        // Sleep in short steps to keep the gap accurate
+        while (now_ns() - start < gap_ns) {
+            struct timespec ts = {0, std::min(gap_ns - (now_ns() - start), 100000L)};
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("p50 %.1f us  p99 %.1f us  max %.1f us\n", latencies[num_msgs / 2] / 1000.0,
+           latencies[(size_t)num_msgs * 99 / 100] / 1000.0, latencies.back() / 1000.0);
+
+    close(senderfd);
+    close(recverfd);
+}
@@ -1,7 +1,9 @@
 #include "common.h"
+#include "frame.h"
 
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 
@@ -10,9 +12,20 @@
 #include <ctime>
 
 #define EPOLLEVENTS     100
+// Send an ack after receiving this many frames, or after being idle for ACK_DELAY_MS, whichever comes first
+#define ACK_BATCH       64
+#define ACK_DELAY_MS    50
 
-int socket_connect(const char* ip_addr, int port) {
+struct AckState {
+    AckState() : last_seq(0), unacked(0) {}
+
+    size_t last_seq; // every frame up to this sequence number has been received
+    size_t unacked;  // number of frames received since the last ack
+};
+
+int socket_connect(const char* ip_addr, int port, const LowLatencyConfig& config) {
     int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    set_low_latency_sockopt(sockfd, config);
 
     struct sockaddr_in addr;
     bzero(&addr, sizeof(addr));
@@ -30,24 +43,46 @@ int socket_connect(const char* ip_addr, int port) {
 }
 
 void req_register(const std::string& username, BlockBuffer* buf_out) {
-    size_t req_len = 2 * sizeof(size_t) + sizeof(int) + username.size();
-    buf_out->write(req_len);
-    buf_out->write(REQ_CS_REGISTER);
-    buf_out->write(username);
+    CSRegister::encode(buf_out, username);
 }
 
-void print_new_msg(Buffer* buf) {
-    std::string sender = buf->get_string();
-    std::string msg = buf->get_string();
+void send_ack(int epollfd, int sockfd, AckState* acks, BlockBuffer* buf_out) {
+    bool has_remaining = !buf_out->empty();
 
+    CSAck::encode(buf_out, acks->last_seq);
+    acks->unacked = 0;
+
+    if (!has_remaining) {
+        modify_event(epollfd, sockfd, EPOLLIN | EPOLLOUT);
+    }
+}
+
+// Return false if the frame is a retransmission that has been received already
+bool accept_seq(size_t seq, AckState* acks) {
+    if (seq <= acks->last_seq) {
+        return false;
+    } else if (seq > acks->last_seq + 1) {
+        fprintf(stderr, "[WARN] %zu message(s) were lost\n", seq - acks->last_seq - 1);
+    }
+    acks->last_seq = seq;
+    ++acks->unacked;
+    return true;
+}
+
+void print_new_msg(const std::string& sender, const std::string& msg) {
     printf("%s says: %s\n", sender.c_str(), msg.c_str());
 }
 
+void print_history_msg(size_t ts_ms, const std::string& sender, const std::string& recver, const std::string& msg) {
+    time_t ts = ts_ms / 1000;
+    char time_str[32];
+    strftime(time_str, sizeof(time_str), "%F %T", localtime(&ts));
+
+    printf("[%s] %s -> %s: %s\n", time_str, sender.c_str(), recver.c_str(), msg.c_str());
+}
+
 // TODO: need speicial treatments on sending files. Currently using a naive implementation
-void recv_new_file(Buffer* buf) {
-    std::string sender = buf->get_string();
-    std::string file_content = buf->get_string();
-    
+void recv_new_file(const std::string& sender, const std::string& file_content) {
     std::string filename = std::to_string(rand());
     FILE* fp = fopen(filename.c_str(), "w");
     fwrite(file_content.c_str(), 1, file_content.size(), fp);
@@ -57,25 +92,55 @@ void recv_new_file(Buffer* buf) {
 }
 
 // TODO: Should I put all requests into one single buffer? It seems that there is no need
-void handle_read(int epollfd, int sockfd, Buffer* buf) {
+void handle_read(int epollfd, int sockfd, Buffer* buf, AckState* acks, BlockBuffer* buf_out) {
     // Read the request. If we have finished reading the request, process it
-    if (handle_read_common(sockfd, buf)) {
+    bool closed = false;
+    if (handle_read_common(sockfd, buf, &closed)) {
         buf->inc_rpos(sizeof(size_t));
         const int* req_type = buf->read<int>();
 
         switch (*req_type) {
-            case REQ_SC_REGISTER_ACK:
+            case REQ_SC_REGISTER_ACK: {
                 fprintf(stderr, "[INFO] Registered successfully\n");
+                // The server resends everything after the last ack, which may come from a previous session
+                std::tie(acks->last_seq) = SCRegisterAck::decode(buf);
                 add_event(epollfd, STDIN_FILENO, EPOLLIN);
                 break;
-            case REQ_SC_NEW_MSG:
-                print_new_msg(buf);
+            }
+            case REQ_SC_NEW_MSG: {
+                auto [seq, sender, msg] = SCNewMsg::decode(buf);
+                if (accept_seq(seq, acks)) {
+                    print_new_msg(sender, msg);
+                }
                 break;
-            case REQ_SC_NEW_FILE:
-                recv_new_file(buf);
+            }
+            case REQ_SC_NEW_FILE: {
+                auto [seq, sender, file_content] = SCNewFile::decode(buf);
+                if (accept_seq(seq, acks)) {
+                    recv_new_file(sender, file_content);
+                }
+                break;
+            }
+            case REQ_SC_HISTORY_MSG: {
+                auto [ts_ms, sender, recver, msg] = SCHistoryMsg::decode(buf);
+                print_history_msg(ts_ms, sender, recver, msg);
+                break;
+            }
+            case REQ_SC_HISTORY_END: {
+                auto [count] = SCHistoryEnd::decode(buf);
+                printf("End of history: %zu message(s)\n", count);
+                break;
+            }
+        }
+
+        if (acks->unacked >= ACK_BATCH) {
+            send_ack(epollfd, sockfd, acks, buf_out);
         }
 
         buf->reset(sizeof(size_t));
+    } else if (closed) {
+        fprintf(stderr, "[FATAL] The server has closed the connection\n");
+        exit(1);
     }
 }
 
@@ -91,22 +156,20 @@ void handle_write(int epollfd, int sockfd, BlockBuffer* buf_out) {
 // Now intentionally does not use sendfile(2) for testing the function of BlockBuffer
 void send_file(const std::string& filename, const std::string& recver, BlockBuffer* buf_out) {
     FILE* fp = fopen(filename.c_str(), "r");
-    fseek(fp, 0, SEEK_END);
-    size_t file_size = ftell(fp);
-    rewind(fp);
-
-    size_t req_len = recver.size() + file_size + 3 * sizeof(size_t) + sizeof(int);
-    buf_out->write(req_len);
-    buf_out->write(REQ_CS_SEND_FILE);
-    buf_out->write(recver);
-    buf_out->write(file_size);
-
-    // TODO: Change to a more reasonable buffer size
-    // Now intentionally use this ugly buffer size for testing the function of BlockBuffer
-    char buf[123];
-    size_t len;
-    while ((len = fread(buf, 1, 123, fp)) > 0) {
-        buf_out->write(buf, buf + len);
+    if (fp == NULL) {
+        perror("[ERROR] fopen()");
+        return;
+    }
+    // fopen() also succeeds on a directory, whose size is meaningless
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "[ERROR] %s is not a regular file\n", filename.c_str());
+        fclose(fp);
+        return;
+    }
+
+    if (!CSSendFile::encode(buf_out, recver, FileContent{fp, (size_t)st.st_size})) {
+        fprintf(stderr, "[ERROR] %s has changed while being sent. Not sent\n", filename.c_str());
     }
 
     fclose(fp);
@@ -130,15 +193,21 @@ void handle_stdin(int epollfd, int sockfd, BlockBuffer* buf_out) {
                 std::string recver = raw_msg.substr(5, colon_pos - 5);
                 std::string filename = raw_msg.substr(colon_pos + 2);
                 send_file(filename, recver, buf_out);
+            // "history <user>: <n>" queries the last n messages with the user
+            } else if (raw_msg.substr(0, 8) == "history ") {
+                std::string peer = raw_msg.substr(8, colon_pos - 8);
+                size_t limit = strtoul(raw_msg.c_str() + colon_pos + 2, NULL, 10);
+                CSQueryHistory::encode(buf_out, HISTORY_CONVERSATION, peer, limit);
+            // "search <n>: <keywords>" queries the last n messages containing all the keywords
+            } else if (raw_msg.substr(0, 7) == "search ") {
+                size_t limit = strtoul(raw_msg.c_str() + 7, NULL, 10);
+                std::string keywords = raw_msg.substr(colon_pos + 2);
+                CSQueryHistory::encode(buf_out, HISTORY_SEARCH, keywords, limit);
             } else {
                 std::string recver = raw_msg.substr(0, colon_pos);
                 std::string msg = raw_msg.substr(colon_pos + 2);
 
-                size_t req_len = recver.size() + msg.size() + 3 * sizeof(size_t) + sizeof(int);
-                buf_out->write(req_len);
-                buf_out->write(REQ_CS_SEND_MSG);
-                buf_out->write(recver);
-                buf_out->write(msg);
+                CSSendMsg::encode(buf_out, recver, msg);
             }
         } else {
             buf_[len] = 0;
@@ -152,35 +221,48 @@ void handle_stdin(int epollfd, int sockfd, BlockBuffer* buf_out) {
 }
 
 int main(int argc, char** argv) {
-    if (argc != 4) {
-        printf("Usage: ./client <ip_addr> <port> <username>\n");
+    LowLatencyConfig config;
+    bool valid_args = argc >= 4;
+    for (int i = 4; i < argc; ++i) {
+        valid_args &= parse_low_latency_arg(argv[i], &config);
+    }
+    if (!valid_args) {
+        printf("Usage: ./client <ip_addr> <port> <username> [--low-latency[=<busy_poll_us>]] [--cpu=<n>]\n");
+        return 1;
     }
 
+    pin_to_cpu(config);
+
     srand(time(NULL));
 
-    int sockfd = socket_connect(argv[1], atoi(argv[2]));
+    int sockfd = socket_connect(argv[1], atoi(argv[2]), config);
 
     int epollfd = epoll_create(1);
     add_event(epollfd, sockfd, EPOLLIN | EPOLLOUT);
 
     struct epoll_event events[EPOLLEVENTS];
+    BusyPoller poller(epollfd, config);
 
     int has_connect_error = -1;
 
     Buffer buf(sizeof(size_t));
     BlockBuffer buf_out;
+    AckState acks;
 
     req_register(argv[3], &buf_out);
 
     fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
     
     for (;;) {
-        int num = epoll_wait(epollfd, events, EPOLLEVENTS, -1);
+        int num = poller.wait(events, EPOLLEVENTS, acks.unacked > 0 ? ACK_DELAY_MS : -1);
+        if (num == 0) {
+            send_ack(epollfd, sockfd, &acks, &buf_out);
+        }
         for (int i = 0; i < num; ++i) {
             int fd = events[i].data.fd;
             if (fd == sockfd) {
                 if (events[i].events & EPOLLIN) {
-                    handle_read(epollfd, sockfd, &buf);
+                    handle_read(epollfd, sockfd, &buf, &acks, &buf_out);
                 }
 
                 if (events[i].events & EPOLLOUT) {
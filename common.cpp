@@ -1,8 +1,17 @@
 #include "common.h"
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
 #include <unistd.h>
 
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
 void add_event(int epollfd, int fd, int events) {
     struct epoll_event event;
     event.events = events;
@@ -27,8 +36,120 @@ void delete_event(int epollfd, int fd) {
     }
 }
 
-// TODO: handle disconnection properly
-bool handle_read_common(int clientfd, Buffer* buf) {
+bool parse_low_latency_arg(const char* arg, LowLatencyConfig* config) {
+    if (strcmp(arg, "--low-latency") == 0) {
+        config->enabled = true;
+    } else if (strncmp(arg, "--low-latency=", 14) == 0) {
+        // SO_BUSY_POLL fails with EINVAL on a negative value
+        char* end;
+        long busy_poll_us = strtol(arg + 14, &end, 10);
+        if (end == arg + 14 || *end != '\0' || busy_poll_us < 0 || busy_poll_us > INT_MAX) {
+            fprintf(stderr, "[ERROR] Invalid busy poll interval: %s\n", arg + 14);
+            return false;
+        }
+        config->enabled = true;
+        config->busy_poll_us = busy_poll_us;
+    } else if (strncmp(arg, "--cpu=", 6) == 0) {
+        // CPU_SET() is undefined for CPUs out of the range of cpu_set_t
+        char* end;
+        long cpu = strtol(arg + 6, &end, 10);
+        if (end == arg + 6 || *end != '\0' || cpu < -1 || cpu >= CPU_SETSIZE) {
+            fprintf(stderr, "[ERROR] Invalid CPU: %s\n", arg + 6);
+            return false;
+        }
+        config->cpu = cpu;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void set_low_latency_sockopt(int fd, const LowLatencyConfig& config) {
+    if (!config.enabled) {
+        return;
+    }
+
+    int nodelay = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+        perror("[WARN] setsockopt(TCP_NODELAY)");
+    }
+    // Raising SO_BUSY_POLL above net.core.busy_read requires CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &config.busy_poll_us, sizeof(config.busy_poll_us)) < 0) {
+        perror("[WARN] setsockopt(SO_BUSY_POLL)");
+    }
+}
+
+// Set once by pin_to_cpu() before any helper thread is started
+static bool pinned = false;
+static cpu_set_t initial_cpuset;
+
+void pin_to_cpu(const LowLatencyConfig& config) {
+    if (config.cpu < 0) {
+        return;
+    }
+    if (sched_getaffinity(0, sizeof(initial_cpuset), &initial_cpuset) < 0) {
+        perror("[WARN] sched_getaffinity()");
+        return;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(config.cpu, &cpuset);
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) < 0) {
+        perror("[WARN] sched_setaffinity()");
+        return;
+    }
+    pinned = true;
+}
+
+void unpin_from_cpu() {
+    if (pinned && sched_setaffinity(0, sizeof(initial_cpuset), &initial_cpuset) < 0) {
+        perror("[WARN] sched_setaffinity()");
+    }
+}
+
+static inline long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+BusyPoller::BusyPoller(int epollfd, const LowLatencyConfig& config) : epollfd_(epollfd), enabled_(config.enabled) {
+    int spin_us = std::min(std::max(config.busy_poll_us, BUSY_POLL_MIN_US), BUSY_POLL_MAX_US);
+    spin_ns_ = spin_us * 1000L;
+}
+
+int BusyPoller::wait(struct epoll_event* events, int maxevents, int timeout) {
+    if (!enabled_) {
+        return epoll_wait(epollfd_, events, maxevents, timeout);
+    }
+
+    int num = epoll_wait(epollfd_, events, maxevents, 0);
+    // Still busy, no need to adjust the spin interval
+    if (num != 0) {
+        return num;
+    }
+
+    long start = now_ns();
+    do {
+        num = epoll_wait(epollfd_, events, maxevents, 0);
+        if (num != 0) {
+            return num;
+        }
+    } while (now_ns() - start < spin_ns_);
+
+    num = epoll_wait(epollfd_, events, maxevents, timeout);
+    // Spin long enough to catch an event after a similar idle period next time, unless such a long spin is too costly
+    long idle_ns = now_ns() - start;
+    if (num > 0 && idle_ns < BUSY_POLL_MAX_US * 1000L) {
+        spin_ns_ = std::min(idle_ns * 2, BUSY_POLL_MAX_US * 1000L);
+    } else {
+        spin_ns_ = std::max(spin_ns_ / 2, BUSY_POLL_MIN_US * 1000L);
+    }
+    return num;
+}
+
+bool handle_read_common(int clientfd, Buffer* buf, bool* closed) {
     size_t* req_len = (size_t*)buf->get_rptr(0); // the value pointed to may not be valid
 
     // Read the request length if we have not got it yet
@@ -36,6 +157,7 @@ bool handle_read_common(int clientfd, Buffer* buf) {
         ssize_t len = buf->input_from_fd(clientfd);
         if (len == 0) {
             close(clientfd);
+            *closed = true;
             return false;
         } else if (len < 0) {
             return false;
@@ -48,6 +170,7 @@ bool handle_read_common(int clientfd, Buffer* buf) {
                 len = buf->input_from_fd(clientfd);
                 if (len == 0) {
                     close(clientfd);
+                    *closed = true;
                     return false;
                 } else if (len < 0) {
                     return false;
@@ -61,6 +184,7 @@ bool handle_read_common(int clientfd, Buffer* buf) {
         ssize_t len = buf->input_from_fd(clientfd);
         if (len == 0) {
             close(clientfd);
+            *closed = true;
             return false;
         } else if (len < 0) {
             return false;
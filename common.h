@@ -1,11 +1,15 @@
+#pragma once
+
+#include <sys/epoll.h>
 #include <unistd.h>
 
 #include <cstddef>
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <cassert>
-#include <queue>
+#include <deque>
 #include <memory>
 
 #define REQ_CS_REGISTER         1
@@ -14,13 +18,63 @@
 #define REQ_SC_REGISTER_ACK     4
 #define REQ_CS_SEND_FILE        5
 #define REQ_SC_NEW_FILE         6
+#define REQ_CS_ACK              7
+#define REQ_CS_QUERY_HISTORY    8
+#define REQ_SC_HISTORY_MSG      9
+#define REQ_SC_HISTORY_END      10
+
+// Kinds of history queries
+#define HISTORY_CONVERSATION    0   // the last messages between the user and another user
+#define HISTORY_SEARCH          1   // the last messages of the user containing all the keywords
+
+// Maximum number and total size of unacknowledged frames kept for each receiver
+#define DELIVERY_WINDOW         1024
+#define DELIVERY_WINDOW_BYTES   (16 << 20)
+
+// Bounds of the adaptive spin interval of BusyPoller
+#define BUSY_POLL_MIN_US        5
+#define BUSY_POLL_MAX_US        1000
 
 void add_event(int epollfd, int fd, int events);
 void modify_event(int epollfd, int fd, int events);
 void delete_event(int epollfd, int fd);
 
+// Options of the opt-in low-latency mode, which trades CPU time for wakeup latency
+struct LowLatencyConfig {
+    LowLatencyConfig() : enabled(false), busy_poll_us(50), cpu(-1) {}
+
+    bool enabled;
+    int busy_poll_us;   // SO_BUSY_POLL of the sockets, also the initial spin interval of the event loop
+    int cpu;            // pin the event loop to this CPU, -1 for no pinning
+};
+
+// Parse "--low-latency[=<busy_poll_us>]" or "--cpu=<n>". Return false if arg is neither of them or has an invalid value
+bool parse_low_latency_arg(const char* arg, LowLatencyConfig* config);
+// Set TCP_NODELAY and SO_BUSY_POLL on the socket if the low-latency mode is enabled
+void set_low_latency_sockopt(int fd, const LowLatencyConfig& config);
+// Pin the calling thread to config.cpu if it is set
+void pin_to_cpu(const LowLatencyConfig& config);
+// Give the calling thread the affinity the process had before pin_to_cpu(). Threads started by a pinned thread inherit
+// its CPU, so helper threads call this to stay off the CPU of the event loop
+void unpin_from_cpu();
+
+// epoll_wait that spins with a zero timeout for a while before blocking. The spin interval adapts to the traffic:
+// after blocking, it is set to twice the idle period if that is shorter than BUSY_POLL_MAX_US, otherwise it is halved
+// down to BUSY_POLL_MIN_US.
+// If the low-latency mode is disabled, it is the same as epoll_wait.
+class BusyPoller {
+ public:
+    BusyPoller(int epollfd, const LowLatencyConfig& config);
+
+    int wait(struct epoll_event* events, int maxevents, int timeout);
+
+ private:
+    int epollfd_;
+    bool enabled_;
+    long spin_ns_;
+};
+
 // TODO: allow pruning read segment
-// TODO: better API for adding a new request (e.g. no need to compute the request length by the user)
 class Buffer {
  public:
     Buffer() : wpos_(0), rpos_(0) {}
@@ -147,12 +201,12 @@ class Buffer {
 
 class BlockBuffer {
  public:
-    BlockBuffer() : rpos_(0) {
+    BlockBuffer() : rpos_(0), total_written_(0), total_flushed_(0) {
         block_size_ = sysconf(_SC_PAGESIZE);
         wpos_ = block_size_;
     }
 
-    BlockBuffer(ssize_t block_size) : rpos_(0) {
+    BlockBuffer(ssize_t block_size) : rpos_(0), total_written_(0), total_flushed_(0) {
         if (block_size == -1) {
             block_size_ = sysconf(_SC_PAGESIZE);
         } else {
@@ -166,12 +220,13 @@ class BlockBuffer {
         //if (write_start >= write_end) {
         //    return;
         //}
+        total_written_ += write_end - write_start;
         while (write_start < write_end) {
             if (wpos_ == block_size_) {
                 if (free_list_.empty()) {
-                    buf_.emplace(new char[block_size_]);
+                    buf_.emplace_back(new char[block_size_]);
                 } else {
-                    buf_.push(std::move(free_list_.back()));
+                    buf_.push_back(std::move(free_list_.back()));
                     free_list_.pop_back();
                 }
                 wpos_ = 0;
@@ -189,6 +244,67 @@ class BlockBuffer {
         write((const char*)&ptr, (const char*)&ptr + sizeof(T));
     }
 
+    // If len more bytes fit in the last block, return where to write them and treat them as written. Otherwise, return
+    // nullptr and write nothing
+    char* try_claim_contiguous(size_t len) {
+        if (wpos_ == block_size_) {
+            if (free_list_.empty()) {
+                buf_.emplace_back(new char[block_size_]);
+            } else {
+                buf_.push_back(std::move(free_list_.back()));
+                free_list_.pop_back();
+            }
+            wpos_ = 0;
+        }
+
+        if (len > block_size_ - wpos_) {
+            return nullptr;
+        }
+        char* res = buf_.back().get() + wpos_;
+        wpos_ += len;
+        total_written_ += len;
+        return res;
+    }
+
+    // Make sure that writing len more bytes does not allocate memory
+    void preallocate(size_t len) {
+        size_t room = block_size_ - wpos_;
+        if (len <= room) {
+            return;
+        }
+        size_t num_blocks = (len - room + block_size_ - 1) / block_size_;
+        while (free_list_.size() < num_blocks) {
+            free_list_.emplace_back(new char[block_size_]);
+        }
+    }
+
+    // Remove the last len bytes written, which must not have been flushed yet
+    void truncate(size_t len) {
+        total_written_ -= len;
+        while (len > wpos_) {
+            len -= wpos_;
+            free_list_.push_back(std::move(buf_.back()));
+            buf_.pop_back();
+            wpos_ = block_size_;
+        }
+        wpos_ -= len;
+    }
+
+    // Copy the last len bytes written, which must not have been flushed yet
+    void copy_last(size_t len, char* out) const {
+        size_t idx = buf_.size() - 1;
+        size_t end = wpos_;
+        char* out_end = out + len;
+        while (len > 0) {
+            size_t to_copy = std::min(len, end);
+            out_end -= to_copy;
+            std::copy(buf_[idx].get() + end - to_copy, buf_[idx].get() + end, out_end);
+            len -= to_copy;
+            --idx;
+            end = block_size_;
+        }
+    }
+
     void write(const std::string& str) {
         size_t size = str.size();
         write(size);
@@ -227,7 +343,7 @@ class BlockBuffer {
             if (rpos_ == block_size_) {
                 // TODO: May want to actually free the memory
                 free_list_.push_back(std::move(buf_.front()));
-                buf_.pop();
+                buf_.pop_front();
                 rpos_ = 0;
 
                 if (buf_.empty()) {
@@ -236,6 +352,7 @@ class BlockBuffer {
             }
         }
 
+        total_flushed_ += total_len;
         return total_len;
     }
 
@@ -243,17 +360,90 @@ class BlockBuffer {
         return buf_.empty() || (buf_.size() == 1 && rpos_ == wpos_);
     }
 
+    // Number of bytes ever written into the buffer and written out of it respectively
+    inline size_t total_written() const {
+        return total_written_;
+    }
+
+    inline size_t total_flushed() const {
+        return total_flushed_;
+    }
+
  private:
     size_t block_size_;
-    std::queue<std::unique_ptr<char[]>> buf_;
+    std::deque<std::unique_ptr<char[]>> buf_;
     std::vector<std::unique_ptr<char[]>> free_list_;
     size_t wpos_, rpos_;
+    size_t total_written_, total_flushed_;
+};
+
+// Frames delivered to a user but not acknowledged yet, kept for retransmission after a reconnection.
+// Sequence numbers are assigned per receiver starting from 1, and acks are cumulative.
+class DeliveryWindow {
+ public:
+    DeliveryWindow() : next_seq_(1), acked_seq_(0), bytes_(0) {}
+
+    inline size_t next_seq() {
+        return next_seq_++;
+    }
+
+    inline size_t acked_seq() const {
+        return acked_seq_;
+    }
+
+    // If the window is full, the oldest frames are dropped and the receiver will see a gap. A frame larger than
+    // DELIVERY_WINDOW_BYTES, e.g. a large file, is not kept at all
+    void push(size_t seq, std::string&& frame) {
+        if (frame.size() > DELIVERY_WINDOW_BYTES) {
+            fprintf(stderr, "[WARN] Frame %zu is too large to keep for retransmission\n", seq);
+            return;
+        }
+        while (frames_.size() == DELIVERY_WINDOW || bytes_ + frame.size() > DELIVERY_WINDOW_BYTES) {
+            fprintf(stderr, "[WARN] Delivery window full, dropping frame %zu\n", frames_.front().first);
+            pop_front();
+        }
+        bytes_ += frame.size();
+        frames_.emplace_back(seq, std::move(frame));
+    }
+
+    // An ack beyond the last frame sent is clamped, otherwise it would be sent back at the next registration and the
+    // receiver would take every new frame for a duplicate
+    void ack(size_t seq) {
+        if (seq >= next_seq_) {
+            fprintf(stderr, "[WARN] Ack %zu beyond the last frame %zu\n", seq, next_seq_ - 1);
+            seq = next_seq_ - 1;
+        }
+        while (!frames_.empty() && frames_.front().first <= seq) {
+            pop_front();
+        }
+        if (seq > acked_seq_) {
+            acked_seq_ = seq;
+        }
+    }
+
+    void retransmit(BlockBuffer* buf_out) const {
+        for (const auto& frame : frames_) {
+            buf_out->write(frame.second.data(), frame.second.data() + frame.second.size());
+        }
+    }
+
+ private:
+    inline void pop_front() {
+        bytes_ -= frames_.front().second.size();
+        frames_.pop_front();
+    }
+
+    std::deque<std::pair<size_t, std::string>> frames_;
+    size_t next_seq_, acked_seq_;
+    size_t bytes_;
 };
 
 using UsernameFd = std::unordered_map<std::string, int>;
 using FdUsername = std::unordered_map<int, std::string>;
 using FdBuffer = std::unordered_map<int, Buffer>;
 using FdBlockBuffer = std::unordered_map<int, BlockBuffer>;
+using UsernameWindow = std::unordered_map<std::string, DeliveryWindow>;
 
-bool handle_read_common(int clientfd, Buffer* buf);
+// Read a frame into the buffer and return true if it is complete. On EOF, close the connection and set *closed
+bool handle_read_common(int clientfd, Buffer* buf, bool* closed);
 
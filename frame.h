@@ -0,0 +1,217 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+// Declarative frame schemas. Every frame is laid out as
+//     size_t req_len | int req_type | field | field | ...
+// where a fixed-size field is written as is and a std::string field is written as its size_t length followed by
+// its bytes. Frame<REQ_*, Fields...> generates the encoder and the decoder from the list of field types.
+
+// Frames larger than this, e.g. files, are not preallocated as a whole but written block by block
+#define FRAME_PREALLOCATE_MAX   (1 << 20)
+
+// Content of a file, encoded as a std::string field without loading the whole file into memory
+struct FileContent {
+    FILE* fp;
+    size_t size;
+};
+
+template <typename T>
+struct FieldTraits {
+    static_assert(std::is_trivially_copyable<T>::value, "fixed-size fields must be trivially copyable");
+
+    using wire_type = T;
+    static constexpr size_t fixed_size = sizeof(T);
+
+    static constexpr size_t dynamic_size(const T&) {
+        return 0;
+    }
+
+    static inline char* encode(char* p, const T& val) {
+        memcpy(p, &val, sizeof(T));
+        return p + sizeof(T);
+    }
+
+    static inline bool encode(BlockBuffer* buf_out, const T& val) {
+        buf_out->write(val);
+        return true;
+    }
+
+    static inline T decode(Buffer* buf) {
+        return *buf->read<T>();
+    }
+};
+
+template <>
+struct FieldTraits<std::string> {
+    using wire_type = std::string;
+    static constexpr size_t fixed_size = sizeof(size_t);
+
+    static inline size_t dynamic_size(const std::string& str) {
+        return str.size();
+    }
+
+    static inline char* encode(char* p, const std::string& str) {
+        p = FieldTraits<size_t>::encode(p, str.size());
+        memcpy(p, str.data(), str.size());
+        return p + str.size();
+    }
+
+    static inline bool encode(BlockBuffer* buf_out, const std::string& str) {
+        buf_out->write(str);
+        return true;
+    }
+
+    static inline std::string decode(Buffer* buf) {
+        return buf->get_string();
+    }
+};
+
+// Encode only. It is decoded as a std::string
+template <>
+struct FieldTraits<FileContent> {
+    using wire_type = std::string;
+    static constexpr size_t fixed_size = sizeof(size_t);
+
+    static inline size_t dynamic_size(const FileContent& file) {
+        return file.size;
+    }
+
+    // Fail if the file has become shorter than file.size
+    static inline char* encode(char* p, const FileContent& file) {
+        p = FieldTraits<size_t>::encode(p, file.size);
+        if (fread(p, 1, file.size, file.fp) != file.size) {
+            return nullptr;
+        }
+        return p + file.size;
+    }
+
+    static bool encode(BlockBuffer* buf_out, const FileContent& file) {
+        buf_out->write(file.size);
+
+        // TODO: Change to a more reasonable buffer size
+        // Now intentionally use this ugly buffer size for testing the function of BlockBuffer
+        char buf[123];
+        size_t remaining = file.size;
+        while (remaining > 0) {
+            size_t len = fread(buf, 1, std::min(remaining, sizeof(buf)), file.fp);
+            if (len == 0) {
+                return false;
+            }
+            buf_out->write(buf, buf + len);
+            remaining -= len;
+        }
+        return true;
+    }
+};
+
+template <int ReqType, typename... Fields>
+class Frame {
+ public:
+    static constexpr int req_type = ReqType;
+
+    // Size of the frame excluding the bytes of variable-length fields
+    static constexpr size_t header_size = sizeof(size_t) + sizeof(int) + (FieldTraits<Fields>::fixed_size + ... + 0);
+
+    template <typename... Args>
+    static inline size_t size(const Args&... args) {
+        check_args<Args...>();
+        return header_size + (FieldTraits<Args>::dynamic_size(args) + ... + (size_t)0);
+    }
+
+    // Encode into at least size(args...) bytes of contiguous memory. Returns the end of the frame, or nullptr if a
+    // field fails to encode, e.g. a file cannot be read
+    template <typename... Args>
+    static inline char* encode(char* p, const Args&... args) {
+        return encode_fields(p, size(args...), args...);
+    }
+
+    // Append the frame to the buffer. Fields are copied in one pass if the frame fits in the current block.
+    // If a field fails to encode, nothing is appended and false is returned
+    template <typename... Args>
+    static inline bool encode(BlockBuffer* buf_out, const Args&... args) {
+        size_t req_len = size(args...);
+        char* p = buf_out->try_claim_contiguous(req_len);
+        if (p != nullptr) {
+            if (encode_fields(p, req_len, args...) == nullptr) {
+                buf_out->truncate(req_len);
+                return false;
+            }
+            return true;
+        }
+
+        size_t start = buf_out->total_written();
+        buf_out->preallocate(std::min(req_len, (size_t)FRAME_PREALLOCATE_MAX));
+        buf_out->write(req_len);
+        buf_out->write(ReqType);
+        if (!(FieldTraits<Args>::encode(buf_out, args) && ...)) {
+            buf_out->truncate(buf_out->total_written() - start);
+            return false;
+        }
+        return true;
+    }
+
+    // Append the frame to the buffer and return a copy of it, e.g. for retransmission. The fields are encoded only once.
+    // Returns an empty string if a field fails to encode
+    template <typename... Args>
+    static inline std::string encode_and_copy(BlockBuffer* buf_out, const Args&... args) {
+        if (!encode(buf_out, args...)) {
+            return std::string();
+        }
+        std::string frame(size(args...), '\0');
+        buf_out->copy_last(frame.size(), &frame[0]);
+        return frame;
+    }
+
+    // Encode into a new string, e.g. for keeping a copy of the frame. Returns an empty string if a field fails to encode
+    template <typename... Args>
+    static inline std::string encode_to_string(const Args&... args) {
+        std::string frame(size(args...), '\0');
+        if (encode(&frame[0], args...) == nullptr) {
+            return std::string();
+        }
+        return frame;
+    }
+
+    // Decode the fields. The read position of the buffer should be right after the request type
+    static inline std::tuple<Fields...> decode(Buffer* buf) {
+        // Elements of a braced initializer list are evaluated in order
+        return std::tuple<Fields...>{FieldTraits<Fields>::decode(buf)...};
+    }
+
+ private:
+    template <typename... Args>
+    static constexpr void check_args() {
+        static_assert(sizeof...(Args) == sizeof...(Fields), "wrong number of fields");
+        static_assert((std::is_same<typename FieldTraits<Args>::wire_type, Fields>::value && ...), "wrong field types");
+    }
+
+    template <typename... Args>
+    static inline char* encode_fields(char* p, size_t req_len, const Args&... args) {
+        p = FieldTraits<size_t>::encode(p, req_len);
+        p = FieldTraits<int>::encode(p, ReqType);
+        // Stop at the first field that fails
+        if (!(((p = FieldTraits<Args>::encode(p, args)) != nullptr) && ...)) {
+            return nullptr;
+        }
+        return p;
+    }
+};
+
+using CSRegister = Frame<REQ_CS_REGISTER, std::string>;                         // username
+using CSSendMsg = Frame<REQ_CS_SEND_MSG, std::string, std::string>;             // receiver, message
+using CSSendFile = Frame<REQ_CS_SEND_FILE, std::string, std::string>;           // receiver, file content
+using CSAck = Frame<REQ_CS_ACK, size_t>;                                        // last received sequence number
+using CSQueryHistory = Frame<REQ_CS_QUERY_HISTORY, int, std::string, size_t>;   // HISTORY_*, peer or keywords, limit
+using SCRegisterAck = Frame<REQ_SC_REGISTER_ACK, size_t>;                       // last acked sequence number
+using SCNewMsg = Frame<REQ_SC_NEW_MSG, size_t, std::string, std::string>;       // sequence number, sender, message
+using SCNewFile = Frame<REQ_SC_NEW_FILE, size_t, std::string, std::string>;     // sequence number, sender, file content
+using SCHistoryMsg = Frame<REQ_SC_HISTORY_MSG, size_t, std::string, std::string, std::string>; // time in ms, sender, receiver, message
+using SCHistoryEnd = Frame<REQ_SC_HISTORY_END, size_t>;                         // number of messages
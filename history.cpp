@@ -0,0 +1,1305 @@
+#include "history.h"
+#include "common.h"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <string_view>
+
+#define SEGMENT_MAGIC           "TIMSEG01"
+#define SEGMENT_MAGIC_LEN       8
+
+#define INDEX_MAGIC             "TIMIDX02"
+#define INDEX_MAGIC_LEN         8
+
+#define WAL_NAME                "active.wal"
+#define WAL_MAGIC               "TIMWAL01"
+#define WAL_MAGIC_LEN           8
+
+#define LZ_HASH_BITS            16
+#define LZ_MIN_MATCH            4
+#define LZ_MAX_OFFSET           65536
+
+static void put_varint(std::string* out, uint64_t val) {
+    while (val >= 0x80) {
+        out->push_back((char)(val | 0x80));
+        val >>= 7;
+    }
+    out->push_back((char)val);
+}
+
+static bool get_varint(const char** p, const char* end, uint64_t* val) {
+    uint64_t res = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        res |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *val = res;
+            return true;
+        }
+    }
+    return false;
+}
+
+// A minimal LZ77 codec for the message column. The output is a sequence of
+//     varint literal_len | literals | varint offset | varint (match_len - LZ_MIN_MATCH)
+// ending with a literal run.
+static void lz_compress(const std::string& in, std::string* out) {
+    std::vector<int64_t> table(1 << LZ_HASH_BITS, -1);
+    const char* src = in.data();
+    size_t len = in.size();
+    size_t pos = 0, lit_start = 0;
+
+    while (pos + LZ_MIN_MATCH <= len) {
+        uint32_t seq;
+        memcpy(&seq, src + pos, sizeof(seq));
+        uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int64_t cand = table[hash];
+        table[hash] = pos;
+
+        if (cand >= 0 && pos - cand <= LZ_MAX_OFFSET && memcmp(src + cand, src + pos, LZ_MIN_MATCH) == 0) {
+            size_t match_len = LZ_MIN_MATCH;
+            while (pos + match_len < len && src[cand + match_len] == src[pos + match_len]) {
+                ++match_len;
+            }
+            put_varint(out, pos - lit_start);
+            out->append(src + lit_start, pos - lit_start);
+            put_varint(out, pos - cand);
+            put_varint(out, match_len - LZ_MIN_MATCH);
+            pos += match_len;
+            lit_start = pos;
+        } else {
+            ++pos;
+        }
+    }
+
+    put_varint(out, len - lit_start);
+    out->append(src + lit_start, len - lit_start);
+}
+
+static bool lz_decompress(const char* p, const char* end, size_t raw_len, std::string* out) {
+    out->clear();
+    out->reserve(raw_len);
+
+    for (;;) {
+        uint64_t lit_len;
+        if (!get_varint(&p, end, &lit_len) || lit_len > (uint64_t)(end - p) || lit_len > raw_len - out->size()) {
+            return false;
+        }
+        out->append(p, lit_len);
+        p += lit_len;
+        if (p == end) {
+            break;
+        }
+
+        uint64_t offset, match_len;
+        if (!get_varint(&p, end, &offset) || !get_varint(&p, end, &match_len) || offset == 0 || offset > out->size()) {
+            return false;
+        }
+        // Never grow past raw_len, whatever a corrupted match length says
+        if (out->size() + LZ_MIN_MATCH > raw_len || match_len > raw_len - out->size() - LZ_MIN_MATCH) {
+            return false;
+        }
+        // The match may overlap with itself, so copy byte by byte
+        size_t from = out->size() - offset;
+        for (size_t i = 0; i < match_len + LZ_MIN_MATCH; ++i) {
+            out->push_back((*out)[from + i]);
+        }
+    }
+
+    return out->size() == raw_len;
+}
+
+// A block stores each column contiguously:
+//     varint rows | zigzag-delta timestamps | senders | receivers | message lengths |
+//     varint raw_len | varint compressed_len | LZ-compressed messages
+static void encode_block(const HistoryColumns& cols, size_t begin, size_t end, std::string* out) {
+    put_varint(out, end - begin);
+
+    uint64_t prev_ts = 0;
+    for (size_t i = begin; i < end; ++i) {
+        int64_t delta = cols.ts_ms[i] - prev_ts;
+        put_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        prev_ts = cols.ts_ms[i];
+    }
+    for (size_t i = begin; i < end; ++i) {
+        put_varint(out, cols.sender[i]);
+    }
+    for (size_t i = begin; i < end; ++i) {
+        put_varint(out, cols.recver[i]);
+    }
+    for (size_t i = begin; i < end; ++i) {
+        put_varint(out, cols.msg_offsets[i + 1] - cols.msg_offsets[i]);
+    }
+
+    std::string raw(cols.msg_data, cols.msg_offsets[begin], cols.msg_offsets[end] - cols.msg_offsets[begin]);
+    std::string compressed;
+    lz_compress(raw, &compressed);
+    put_varint(out, raw.size());
+    put_varint(out, compressed.size());
+    *out += compressed;
+}
+
+static bool decode_block(const char* p, const char* end, size_t num_names, HistoryColumns* cols) {
+    uint64_t rows, val;
+    if (!get_varint(&p, end, &rows) || rows > HISTORY_BLOCK_ROWS) {
+        return false;
+    }
+
+    cols->ts_ms.resize(rows);
+    uint64_t prev_ts = 0;
+    for (uint64_t& ts : cols->ts_ms) {
+        if (!get_varint(&p, end, &val)) {
+            return false;
+        }
+        prev_ts += (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+        ts = prev_ts;
+    }
+    for (std::vector<uint32_t>* column : {&cols->sender, &cols->recver}) {
+        column->resize(rows);
+        for (uint32_t& user : *column) {
+            if (!get_varint(&p, end, &val) || val >= num_names) {
+                return false;
+            }
+            user = val;
+        }
+    }
+    cols->msg_offsets.resize(rows + 1);
+    cols->msg_offsets[0] = 0;
+    for (size_t i = 0; i < rows; ++i) {
+        if (!get_varint(&p, end, &val)) {
+            return false;
+        }
+        cols->msg_offsets[i + 1] = cols->msg_offsets[i] + val;
+    }
+
+    uint64_t raw_len, compressed_len;
+    if (!get_varint(&p, end, &raw_len) || !get_varint(&p, end, &compressed_len) || compressed_len != (uint64_t)(end - p)) {
+        return false;
+    }
+    return raw_len == cols->msg_offsets[rows] && lz_decompress(p, end, raw_len, &cols->msg_data);
+}
+
+// Layout of a segment file:
+//     magic | varint rows | varint num_names | names | varint num_blocks | (num_blocks + 1) * uint64_t block offsets |
+//     blocks of HISTORY_BLOCK_ROWS rows
+static std::string encode_segment(const HistoryColumns& cols, const std::vector<std::string>& names) {
+    std::string blocks;
+    std::vector<uint64_t> block_offsets(1, 0);
+    for (size_t begin = 0; begin < cols.size(); begin += HISTORY_BLOCK_ROWS) {
+        encode_block(cols, begin, std::min(begin + HISTORY_BLOCK_ROWS, cols.size()), &blocks);
+        block_offsets.push_back(blocks.size());
+    }
+
+    std::string out(SEGMENT_MAGIC, SEGMENT_MAGIC_LEN);
+    put_varint(&out, cols.size());
+    put_varint(&out, names.size());
+    for (const std::string& name : names) {
+        put_varint(&out, name.size());
+        out += name;
+    }
+    put_varint(&out, block_offsets.size() - 1);
+
+    uint64_t header_size = out.size() + block_offsets.size() * sizeof(uint64_t);
+    for (uint64_t offset : block_offsets) {
+        offset += header_size;
+        out.append((const char*)&offset, sizeof(offset));
+    }
+    out += blocks;
+
+    return out;
+}
+
+// Decode everything before the blocks. data may be only a prefix of the file
+static bool decode_segment_header(const std::string& data, HistorySegmentMeta* meta) {
+    if (data.size() < SEGMENT_MAGIC_LEN || data.compare(0, SEGMENT_MAGIC_LEN, SEGMENT_MAGIC) != 0) {
+        return false;
+    }
+    const char* p = data.data() + SEGMENT_MAGIC_LEN;
+    const char* end = data.data() + data.size();
+
+    uint64_t rows, num_names, num_blocks, val;
+    if (!get_varint(&p, end, &rows) || !get_varint(&p, end, &num_names)) {
+        return false;
+    }
+
+    // Every name takes at least one byte. Do not trust a corrupted count
+    if (num_names > (uint64_t)(end - p)) {
+        return false;
+    }
+    meta->names.resize(num_names);
+    for (std::string& name : meta->names) {
+        if (!get_varint(&p, end, &val) || val > (uint64_t)(end - p)) {
+            return false;
+        }
+        name.assign(p, val);
+        p += val;
+    }
+
+    if (!get_varint(&p, end, &num_blocks) || num_blocks != (rows + HISTORY_BLOCK_ROWS - 1) / HISTORY_BLOCK_ROWS ||
+            (num_blocks + 1) * sizeof(uint64_t) > (uint64_t)(end - p)) {
+        return false;
+    }
+    meta->block_offsets.resize(num_blocks + 1);
+    memcpy(meta->block_offsets.data(), p, meta->block_offsets.size() * sizeof(uint64_t));
+    meta->rows = rows;
+
+    meta->sorted_names.resize(num_names);
+    for (size_t i = 0; i < num_names; ++i) {
+        meta->sorted_names[i] = i;
+    }
+    std::sort(meta->sorted_names.begin(), meta->sorted_names.end(), [meta](uint32_t a, uint32_t b) {
+        return meta->names[a] < meta->names[b];
+    });
+    return std::is_sorted(meta->block_offsets.begin(), meta->block_offsets.end());
+}
+
+static bool read_file(const std::string& path, std::string* data) {
+    FILE* fp = fopen(path.c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    // fopen() also succeeds on a directory
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode)) {
+        fclose(fp);
+        return false;
+    }
+    data->resize(st.st_size);
+    bool res = fread(&(*data)[0], 1, data->size(), fp) == data->size();
+    fclose(fp);
+    return res;
+}
+
+// <partition>-<seq>.seg -> <partition>-<seq>.idx
+static std::string index_path_of(const std::string& segment_path) {
+    return segment_path.substr(0, segment_path.size() - 4) + ".idx";
+}
+
+// Read only as much of the segment file as its header takes
+static bool read_segment_header(const std::string& path, HistorySegmentMeta* meta) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    std::string data;
+    bool success = false;
+    for (size_t len = 4096; !success; len *= 2) {
+        data.resize(std::min(len, (size_t)st.st_size));
+        if (pread(fd, &data[0], data.size(), 0) != (ssize_t)data.size()) {
+            break;
+        }
+        success = decode_segment_header(data, meta);
+        if (data.size() == (size_t)st.st_size) {
+            break;
+        }
+    }
+    close(fd);
+    return success && meta->block_offsets.back() == (uint64_t)st.st_size;
+}
+
+// Write to a temporary file first so that a crash never leaves a partial file behind
+static bool write_file(const std::string& path, const std::string& data) {
+    std::string tmp_path = path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "w");
+    if (fp == NULL) {
+        return false;
+    }
+    bool written = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    written = fclose(fp) == 0 && written;
+    if (!written || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        int err = errno;
+        unlink(tmp_path.c_str());
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+static uint32_t checksum(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// The log is
+//     magic | uint64_t sequence number of the segment file the messages will be sealed into | records
+// and a record is
+//     varint payload_len | varint ts_ms | varint len | sender | varint len | receiver | message | uint32_t checksum
+// where the message takes the rest of the payload. The checksum covers the payload
+static void put_wal_record(std::string* out, uint64_t ts_ms, const std::string& sender, const std::string& recver,
+                           const char* msg, size_t len) {
+    std::string payload;
+    put_varint(&payload, ts_ms);
+    put_varint(&payload, sender.size());
+    payload += sender;
+    put_varint(&payload, recver.size());
+    payload += recver;
+    payload.append(msg, len);
+
+    uint32_t sum = checksum(payload.data(), payload.size());
+    put_varint(out, payload.size());
+    *out += payload;
+    out->append((const char*)&sum, sizeof(sum));
+}
+
+// Returns false if the record is incomplete or corrupted, e.g. torn by a crash while it was being written
+static bool get_wal_record(const char** p, const char* end, uint64_t* ts_ms, std::string* sender, std::string* recver,
+                           std::string* msg) {
+    uint64_t payload_len;
+    if (!get_varint(p, end, &payload_len) || payload_len > (uint64_t)(end - *p) ||
+            sizeof(uint32_t) > (uint64_t)(end - *p) - payload_len) {
+        return false;
+    }
+    const char* payload = *p;
+    const char* payload_end = payload + payload_len;
+    uint32_t sum;
+    memcpy(&sum, payload_end, sizeof(sum));
+    if (sum != checksum(payload, payload_len)) {
+        return false;
+    }
+
+    uint64_t len;
+    if (!get_varint(&payload, payload_end, ts_ms)) {
+        return false;
+    }
+    for (std::string* name : {sender, recver}) {
+        if (!get_varint(&payload, payload_end, &len) || len > (uint64_t)(payload_end - payload)) {
+            return false;
+        }
+        name->assign(payload, len);
+        payload += len;
+    }
+    msg->assign(payload, payload_end);
+    *p = payload_end + sizeof(sum);
+    return true;
+}
+
+// Lowercase runs of ASCII letters and digits. Other bytes above 0x7f are kept so that UTF-8 words stay intact
+static void tokenize(const char* text, size_t len, std::vector<std::string>* tokens) {
+    tokens->clear();
+    std::string token;
+    for (size_t i = 0; i <= len; ++i) {
+        unsigned char c = i < len ? text[i] : ' ';
+        if (isalnum(c) || c >= 0x80) {
+            token.push_back(tolower(c));
+        } else if (!token.empty()) {
+            tokens->push_back(std::move(token));
+            token.clear();
+        }
+    }
+    std::sort(tokens->begin(), tokens->end());
+    tokens->erase(std::unique(tokens->begin(), tokens->end()), tokens->end());
+}
+
+// Layout of an index file, which is looked up in place:
+//     IndexHeader | IndexConversation[num_conversations], sorted by users | IndexToken[num_tokens], sorted by token |
+//     IndexKeyword[num_keywords], sorted by token and then by user | posting lists | token bytes
+// The rows of a posting list are in ascending order, in blocks of HISTORY_POSTING_BLOCK rows. A block is the varint
+// deltas of its rows, the first one from 0. A list of more than one block starts with an IndexSkip for each block, so
+// that the block of a row can be binary searched
+struct IndexHeader {
+    char magic[INDEX_MAGIC_LEN];
+    uint32_t num_rows, num_conversations, num_tokens, num_keywords, posting_bytes, token_bytes;
+};
+
+struct IndexConversation {
+    uint32_t a, b;              // a <= b
+    uint32_t begin, size;       // byte offset into the posting lists, number of rows
+};
+
+struct IndexToken {
+    uint32_t str_begin, str_len;    // token bytes
+    uint32_t begin, size;           // keywords
+};
+
+struct IndexKeyword {
+    uint32_t user;
+    uint32_t begin, size;       // byte offset into the posting lists, number of rows
+};
+
+// Not aligned in the file, so it is copied out
+struct IndexSkip {
+    uint32_t first_row;
+    uint32_t offset;            // from the start of the list
+};
+
+static void encode_posting_list(const std::vector<uint32_t>& rows, std::string* out) {
+    size_t start = out->size();
+    size_t num_blocks = (rows.size() + HISTORY_POSTING_BLOCK - 1) / HISTORY_POSTING_BLOCK;
+    if (num_blocks > 1) {
+        out->append(num_blocks * sizeof(IndexSkip), '\0');
+    }
+    for (size_t block_idx = 0; block_idx < num_blocks; ++block_idx) {
+        size_t begin = block_idx * HISTORY_POSTING_BLOCK;
+        size_t end = std::min(begin + HISTORY_POSTING_BLOCK, rows.size());
+        if (num_blocks > 1) {
+            IndexSkip skip = {rows[begin], (uint32_t)(out->size() - start)};
+            memcpy(&(*out)[start + block_idx * sizeof(IndexSkip)], &skip, sizeof(skip));
+        }
+        uint32_t prev = 0;
+        for (size_t i = begin; i < end; ++i) {
+            put_varint(out, rows[i] - prev);
+            prev = rows[i];
+        }
+    }
+}
+
+HistoryPostingList::HistoryPostingList(const uint32_t* rows, size_t size)
+    : size_(size), rows_(rows), data_(nullptr), end_(nullptr), num_rows_(0), num_blocks_(0), block_idx_(0),
+      block_size_(0) {}
+
+HistoryPostingList::HistoryPostingList(const char* data, const char* end, size_t size, uint32_t num_rows)
+    : size_(size), rows_(nullptr), data_(data), end_(end), num_rows_(num_rows),
+      num_blocks_((size + HISTORY_POSTING_BLOCK - 1) / HISTORY_POSTING_BLOCK), block_idx_(num_blocks_),
+      block_size_(0) {
+    // Rows are distinct, so a longer list is corrupted. Do not trust it for the size of the skip table either
+    if (size_ > num_rows_ || (num_blocks_ > 1 && num_blocks_ * sizeof(IndexSkip) > (size_t)(end_ - data_))) {
+        size_ = num_blocks_ = block_idx_ = 0;
+    }
+}
+
+bool HistoryPostingList::decode_block(size_t block_idx) {
+    if (block_idx == block_idx_) {
+        return true;
+    }
+    block_idx_ = block_idx;
+    block_size_ = 0;
+
+    const char* p = data_;
+    if (num_blocks_ > 1) {
+        IndexSkip skip;
+        memcpy(&skip, data_ + block_idx * sizeof(IndexSkip), sizeof(skip));
+        if (skip.offset > (size_t)(end_ - data_)) {
+            return false;
+        }
+        p += skip.offset;
+    }
+
+    size_t size = std::min((size_t)HISTORY_POSTING_BLOCK, size_ - block_idx * HISTORY_POSTING_BLOCK);
+    uint64_t row = 0, delta;
+    for (size_t i = 0; i < size; ++i) {
+        // Rows must be ascending
+        if (!get_varint(&p, end_, &delta) || (i > 0 && delta == 0) || delta >= num_rows_ - row) {
+            return false;
+        }
+        row += delta;
+        block_[block_size_++] = row;
+    }
+    return true;
+}
+
+bool HistoryPostingList::get(size_t i, uint32_t* row) {
+    if (data_ == nullptr) {
+        *row = rows_[i];
+        return true;
+    }
+    if (!decode_block(i / HISTORY_POSTING_BLOCK) || i % HISTORY_POSTING_BLOCK >= block_size_) {
+        return false;
+    }
+    *row = block_[i % HISTORY_POSTING_BLOCK];
+    return true;
+}
+
+bool HistoryPostingList::contains(uint32_t row) {
+    if (data_ == nullptr) {
+        return std::binary_search(rows_, rows_ + size_, row);
+    }
+    if (num_blocks_ == 0) {
+        return false;
+    }
+
+    // The last block whose first row is not after row
+    size_t block_idx = 0;
+    if (num_blocks_ > 1) {
+        size_t lo = 1, hi = num_blocks_;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            IndexSkip skip;
+            memcpy(&skip, data_ + mid * sizeof(IndexSkip), sizeof(skip));
+            if (skip.first_row <= row) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        block_idx = lo - 1;
+    }
+    decode_block(block_idx);
+    return std::binary_search(block_, block_ + block_size_, row);
+}
+
+void HistoryPostings::add(uint32_t row, uint32_t sender, uint32_t recver, const char* msg, size_t len) {
+    uint32_t a = std::min(sender, recver), b = std::max(sender, recver);
+    conversations_[(uint64_t)a << 32 | b].push_back(row);
+
+    tokenize(msg, len, &tokens_);
+    for (const std::string& token : tokens_) {
+        uint64_t token_id = token_ids_.emplace(token, token_ids_.size()).first->second;
+        keywords_[(uint64_t)sender << 32 | token_id].push_back(row);
+        if (recver != sender) {
+            keywords_[(uint64_t)recver << 32 | token_id].push_back(row);
+        }
+    }
+}
+
+HistoryPostingList HistoryPostings::conversation(uint32_t a, uint32_t b) const {
+    auto it = conversations_.find((uint64_t)std::min(a, b) << 32 | std::max(a, b));
+    if (it == conversations_.end()) {
+        return {nullptr, 0};
+    }
+    return {it->second.data(), it->second.size()};
+}
+
+HistoryPostingList HistoryPostings::keyword(const std::string& token, uint32_t user) const {
+    auto token_it = token_ids_.find(token);
+    if (token_it == token_ids_.end()) {
+        return {nullptr, 0};
+    }
+    auto it = keywords_.find((uint64_t)user << 32 | token_it->second);
+    if (it == keywords_.end()) {
+        return {nullptr, 0};
+    }
+    return {it->second.data(), it->second.size()};
+}
+
+std::string HistoryPostings::encode(size_t num_rows) const {
+    std::string postings;
+    std::vector<uint64_t> conversation_keys;
+    for (const auto& conversation : conversations_) {
+        conversation_keys.push_back(conversation.first);
+    }
+    std::sort(conversation_keys.begin(), conversation_keys.end());
+    std::vector<IndexConversation> conversations;
+    for (uint64_t key : conversation_keys) {
+        const std::vector<uint32_t>& rows = conversations_.find(key)->second;
+        conversations.push_back({(uint32_t)(key >> 32), (uint32_t)key, (uint32_t)postings.size(), (uint32_t)rows.size()});
+        encode_posting_list(rows, &postings);
+    }
+
+    std::vector<std::pair<const std::string*, uint32_t>> sorted_tokens;
+    for (const auto& token : token_ids_) {
+        sorted_tokens.emplace_back(&token.first, token.second);
+    }
+    std::sort(sorted_tokens.begin(), sorted_tokens.end(), [](const std::pair<const std::string*, uint32_t>& a,
+                                                             const std::pair<const std::string*, uint32_t>& b) {
+        return *a.first < *b.first;
+    });
+    std::vector<uint32_t> token_ranks(sorted_tokens.size());
+    std::vector<IndexToken> tokens;
+    std::string token_data;
+    for (const auto& token : sorted_tokens) {
+        token_ranks[token.second] = tokens.size();
+        tokens.push_back({(uint32_t)token_data.size(), (uint32_t)token.first->size(), 0, 0});
+        token_data += *token.first;
+    }
+
+    // (token rank << 32 | user) -> rows
+    std::vector<std::pair<uint64_t, const std::vector<uint32_t>*>> keyword_keys;
+    for (const auto& keyword : keywords_) {
+        uint64_t key = (uint64_t)token_ranks[keyword.first & 0xffffffff] << 32 | keyword.first >> 32;
+        keyword_keys.emplace_back(key, &keyword.second);
+    }
+    std::sort(keyword_keys.begin(), keyword_keys.end());
+    std::vector<IndexKeyword> keywords;
+    for (const auto& keyword : keyword_keys) {
+        IndexToken* token = &tokens[keyword.first >> 32];
+        if (token->size == 0) {
+            token->begin = keywords.size();
+        }
+        ++token->size;
+        const std::vector<uint32_t>& rows = *keyword.second;
+        keywords.push_back({(uint32_t)keyword.first, (uint32_t)postings.size(), (uint32_t)rows.size()});
+        encode_posting_list(rows, &postings);
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, INDEX_MAGIC_LEN);
+    header.num_rows = num_rows;
+    header.num_conversations = conversations.size();
+    header.num_tokens = tokens.size();
+    header.num_keywords = keywords.size();
+    header.posting_bytes = postings.size();
+    header.token_bytes = token_data.size();
+
+    std::string out((const char*)&header, sizeof(header));
+    out.append((const char*)conversations.data(), conversations.size() * sizeof(IndexConversation));
+    out.append((const char*)tokens.data(), tokens.size() * sizeof(IndexToken));
+    out.append((const char*)keywords.data(), keywords.size() * sizeof(IndexKeyword));
+    out += postings;
+    out += token_data;
+    return out;
+}
+
+void HistoryPostings::clear() {
+    token_ids_.clear();
+    conversations_.clear();
+    keywords_.clear();
+}
+
+HistorySegmentIndex::HistorySegmentIndex() : data_(nullptr), size_(0), num_rows_(0) {}
+
+HistorySegmentIndex::~HistorySegmentIndex() {
+    if (data_ != nullptr) {
+        munmap((void*)data_, size_);
+    }
+}
+
+bool HistorySegmentIndex::open(const std::string& path, size_t num_rows) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    // Only the sizes are checked here, so that opening does not read the whole file. Lookups check the ranges they
+    // follow, and treat a corrupted entry as missing
+    const IndexHeader* header = (const IndexHeader*)data;
+    uint64_t size = sizeof(IndexHeader) + (uint64_t)header->num_conversations * sizeof(IndexConversation) +
+            (uint64_t)header->num_tokens * sizeof(IndexToken) + (uint64_t)header->num_keywords * sizeof(IndexKeyword) +
+            (uint64_t)header->posting_bytes + header->token_bytes;
+    if (memcmp(header->magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0 || header->num_rows != num_rows ||
+            size != (uint64_t)st.st_size) {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    data_ = (const char*)data;
+    size_ = st.st_size;
+    num_rows_ = header->num_rows;
+    num_conversations_ = header->num_conversations;
+    num_tokens_ = header->num_tokens;
+    num_keywords_ = header->num_keywords;
+    posting_bytes_ = header->posting_bytes;
+    token_bytes_ = header->token_bytes;
+    conversations_ = data_ + sizeof(IndexHeader);
+    tokens_ = conversations_ + num_conversations_ * sizeof(IndexConversation);
+    keywords_ = tokens_ + num_tokens_ * sizeof(IndexToken);
+    postings_ = keywords_ + num_keywords_ * sizeof(IndexKeyword);
+    token_data_ = postings_ + posting_bytes_;
+    return true;
+}
+
+HistoryPostingList HistorySegmentIndex::conversation(uint32_t a, uint32_t b) const {
+    if (a > b) {
+        std::swap(a, b);
+    }
+    const IndexConversation* begin = (const IndexConversation*)conversations_;
+    const IndexConversation* end = begin + num_conversations_;
+    const IndexConversation* it = std::lower_bound(begin, end, std::make_pair(a, b),
+                                                   [](const IndexConversation& c, const std::pair<uint32_t, uint32_t>& key) {
+        return std::make_pair(c.a, c.b) < key;
+    });
+    if (it == end || it->a != a || it->b != b) {
+        return {nullptr, 0};
+    }
+    return postings(it->begin, it->size);
+}
+
+HistoryPostingList HistorySegmentIndex::keyword(const std::string& token, uint32_t user) const {
+    auto token_of = [this](const IndexToken& t) {
+        if (t.str_begin > token_bytes_ || t.str_len > token_bytes_ - t.str_begin) {
+            return std::string_view();
+        }
+        return std::string_view(token_data_ + t.str_begin, t.str_len);
+    };
+    const IndexToken* tokens_begin = (const IndexToken*)tokens_;
+    const IndexToken* tokens_end = tokens_begin + num_tokens_;
+    const IndexToken* token_it = std::lower_bound(tokens_begin, tokens_end, token,
+                                                  [&token_of](const IndexToken& t, const std::string& token) {
+        return token_of(t) < token;
+    });
+    if (token_it == tokens_end || token_of(*token_it) != token || token_it->begin > num_keywords_ ||
+            token_it->size > num_keywords_ - token_it->begin) {
+        return {nullptr, 0};
+    }
+
+    const IndexKeyword* begin = (const IndexKeyword*)keywords_ + token_it->begin;
+    const IndexKeyword* end = begin + token_it->size;
+    const IndexKeyword* it = std::lower_bound(begin, end, user, [](const IndexKeyword& k, uint32_t user) {
+        return k.user < user;
+    });
+    if (it == end || it->user != user) {
+        return {nullptr, 0};
+    }
+    return postings(it->begin, it->size);
+}
+
+HistoryPostingList HistorySegmentIndex::postings(uint32_t begin, uint32_t size) const {
+    if (begin > posting_bytes_) {
+        return {nullptr, 0};
+    }
+    return {postings_ + begin, postings_ + posting_bytes_, size, num_rows_};
+}
+
+// Decode every block of a sealed segment to build its index file
+static bool rebuild_index(const HistorySegmentMeta& meta, std::string* index_data) {
+    std::string data;
+    if (!read_file(meta.path, &data) || meta.block_offsets.back() != data.size()) {
+        return false;
+    }
+
+    HistoryPostings postings;
+    HistoryColumns cols;
+    for (size_t block_idx = 0; block_idx + 1 < meta.block_offsets.size(); ++block_idx) {
+        const char* block_start = data.data() + meta.block_offsets[block_idx];
+        const char* block_end = data.data() + meta.block_offsets[block_idx + 1];
+        if (!decode_block(block_start, block_end, meta.names.size(), &cols)) {
+            fprintf(stderr, "[ERROR] Corrupted block %zu of history segment: %s\n", block_idx, meta.path.c_str());
+            continue;
+        }
+        for (size_t i = 0; i < cols.size(); ++i) {
+            uint32_t begin = cols.msg_offsets[i];
+            postings.add(block_idx * HISTORY_BLOCK_ROWS + i, cols.sender[i], cols.recver[i],
+                         cols.msg_data.data() + begin, cols.msg_offsets[i + 1] - begin);
+        }
+    }
+
+    *index_data = postings.encode(meta.rows);
+    return true;
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+History::History(const std::string& dir) : dir_(dir), stop_(false), active_partition_(0), next_file_seq_(0), wal_fd_(-1) {
+    if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("[FATAL] mkdir()");
+        exit(1);
+    }
+    eventfd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventfd_ < 0) {
+        perror("[FATAL] eventfd()");
+        exit(1);
+    }
+    worker_ = std::thread(&History::run, this);
+}
+
+History::~History() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_one();
+    worker_.join();
+    close(eventfd_);
+    if (wal_fd_ >= 0) {
+        close(wal_fd_);
+    }
+}
+
+void History::append(const std::string& sender, const std::string& recver, const std::string& msg) {
+    Job job;
+    job.is_query = false;
+    job.ts_ms = now_ms();
+    job.sender = sender;
+    job.recver = recver;
+    job.msg = msg;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    cond_.notify_one();
+}
+
+void History::query(int clientfd, const std::string& username, int kind, const std::string& arg, size_t limit) {
+    Job job;
+    job.is_query = true;
+    job.clientfd = clientfd;
+    job.kind = kind;
+    job.limit = std::min(limit, (size_t)HISTORY_MAX_LIMIT);
+    job.username = username;
+    job.arg = arg;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    cond_.notify_one();
+}
+
+std::vector<HistoryResult> History::take_results() {
+    uint64_t val;
+    if (read(eventfd_, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+        perror("[WARN] read(eventfd)");
+    }
+
+    std::vector<HistoryResult> results;
+    std::lock_guard<std::mutex> lock(mutex_);
+    results.swap(results_);
+    return results;
+}
+
+void History::run() {
+    load();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (jobs_.empty()) {
+            if (stop_) {
+                break;
+            }
+            cond_.wait(lock, [this] { return !jobs_.empty() || stop_; });
+            continue;
+        }
+
+        std::deque<Job> jobs;
+        jobs.swap(jobs_);
+        lock.unlock();
+
+        std::vector<HistoryResult> results;
+        for (const Job& job : jobs) {
+            if (job.is_query) {
+                results.emplace_back();
+                do_query(job, &results.back());
+            } else {
+                do_append(job);
+            }
+        }
+        // One write for the whole batch
+        flush_wal();
+
+        lock.lock();
+        if (!results.empty()) {
+            std::move(results.begin(), results.end(), std::back_inserter(results_));
+            uint64_t val = 1;
+            if (write(eventfd_, &val, sizeof(val)) < 0) {
+                perror("[WARN] write(eventfd)");
+            }
+        }
+    }
+    lock.unlock();
+
+    if (active_.size() > 0) {
+        seal();
+    }
+}
+
+// Open the segment files and their index files. Files are named <partition>-<seq>.seg
+void History::load() {
+    DIR* dp = opendir(dir_.c_str());
+    if (dp == NULL) {
+        perror("[ERROR] opendir()");
+        return;
+    }
+
+    std::vector<std::pair<uint64_t, std::string>> files;
+    struct dirent* entry;
+    while ((entry = readdir(dp)) != NULL) {
+        unsigned long long partition, seq;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%llu-%llu.%7s", &partition, &seq, suffix) == 3 && strcmp(suffix, "seg") == 0) {
+            files.emplace_back(seq, dir_ + "/" + entry->d_name);
+        }
+    }
+    closedir(dp);
+    std::sort(files.begin(), files.end());
+
+    size_t num_messages = 0;
+    for (const auto& file : files) {
+        // Never reuse the name of a file, even a corrupted one
+        next_file_seq_ = file.first + 1;
+
+        HistorySegmentMeta meta;
+        meta.path = file.second;
+        if (!read_segment_header(file.second, &meta)) {
+            fprintf(stderr, "[ERROR] Corrupted history segment: %s\n", file.second.c_str());
+            continue;
+        }
+
+        // Only the header of the segment is read. The index file is only checked here, and mapped again by queries
+        std::string index_path = index_path_of(file.second);
+        HistorySegmentIndex index;
+        if (!index.open(index_path, meta.rows)) {
+            // Missing or corrupted, e.g. the segment was written by a version without index files
+            std::string data;
+            if (!rebuild_index(meta, &data)) {
+                fprintf(stderr, "[ERROR] Corrupted history segment: %s\n", file.second.c_str());
+                continue;
+            }
+            if (!write_file(index_path, data) || !index.open(index_path, meta.rows)) {
+                perror("[ERROR] Failed to write history index");
+                continue;
+            }
+            fprintf(stderr, "[INFO] Rebuilt the index of history segment: %s\n", file.second.c_str());
+        }
+
+        num_messages += meta.rows;
+        segments_.push_back(std::move(meta));
+    }
+
+    fprintf(stderr, "[INFO] Loaded %zu history messages from %zu segments\n", num_messages, segments_.size());
+
+    replay_wal();
+}
+
+// Rebuild the active segment from the log. The log is then rewritten, which also drops a torn record at its end
+void History::replay_wal() {
+    std::string data;
+    if (read_file(dir_ + "/" + WAL_NAME, &data) && !data.empty()) {
+        uint64_t seq = 0;
+        bool valid = data.size() >= WAL_MAGIC_LEN + sizeof(seq) && data.compare(0, WAL_MAGIC_LEN, WAL_MAGIC) == 0;
+        if (valid) {
+            memcpy(&seq, data.data() + WAL_MAGIC_LEN, sizeof(seq));
+        }
+
+        if (!valid) {
+            fprintf(stderr, "[ERROR] Corrupted history log\n");
+        // Otherwise the segment has been sealed, but the server stopped before the log was rewritten
+        } else if (seq >= next_file_seq_) {
+            next_file_seq_ = seq;
+
+            const char* p = data.data() + WAL_MAGIC_LEN + sizeof(seq);
+            const char* end = data.data() + data.size();
+            uint64_t ts_ms;
+            std::string sender, recver, msg;
+            while (p < end) {
+                if (!get_wal_record(&p, end, &ts_ms, &sender, &recver, &msg)) {
+                    fprintf(stderr, "[WARN] Dropped a torn record at the end of the history log\n");
+                    break;
+                }
+                if (active_.size() == 0) {
+                    active_partition_ = ts_ms / HISTORY_PARTITION_MS;
+                }
+                add(ts_ms, sender, recver, msg.data(), msg.size());
+            }
+            fprintf(stderr, "[INFO] Replayed %zu history messages from the log\n", active_.size());
+        }
+    }
+
+    rewrite_wal();
+}
+
+// Write a new log with the messages of the active segment, and replace the old one with it
+bool History::rewrite_wal() {
+    if (wal_fd_ >= 0) {
+        close(wal_fd_);
+        wal_fd_ = -1;
+    }
+    wal_buffer_.clear();
+
+    std::string data(WAL_MAGIC, WAL_MAGIC_LEN);
+    data.append((const char*)&next_file_seq_, sizeof(next_file_seq_));
+    for (size_t i = 0; i < active_.size(); ++i) {
+        uint32_t begin = active_.msg_offsets[i];
+        put_wal_record(&data, active_.ts_ms[i], active_names_[active_.sender[i]], active_names_[active_.recver[i]],
+                       active_.msg_data.data() + begin, active_.msg_offsets[i + 1] - begin);
+    }
+
+    std::string path = dir_ + "/" + WAL_NAME;
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("[ERROR] Failed to create history log");
+        return false;
+    }
+    if (write(fd, data.data(), data.size()) != (ssize_t)data.size() || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        perror("[ERROR] Failed to write history log");
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    wal_fd_ = fd;
+    return true;
+}
+
+// The log is not fsync()ed. It survives a crash of the server, but not of the machine
+void History::flush_wal() {
+    // The last write has failed, and the log may end with a partial record
+    if (wal_fd_ < 0) {
+        rewrite_wal();
+        return;
+    }
+    if (wal_buffer_.empty()) {
+        return;
+    }
+
+    if (write(wal_fd_, wal_buffer_.data(), wal_buffer_.size()) != (ssize_t)wal_buffer_.size()) {
+        perror("[ERROR] Failed to append to history log");
+        close(wal_fd_);
+        wal_fd_ = -1;
+    }
+    wal_buffer_.clear();
+}
+
+void History::do_append(const Job& job) {
+    uint64_t partition = job.ts_ms / HISTORY_PARTITION_MS;
+    if (active_.size() > 0 && (active_.size() >= HISTORY_SEGMENT_ROWS || partition != active_partition_)) {
+        seal();
+    }
+    if (active_.size() == 0) {
+        active_partition_ = partition;
+    }
+
+    put_wal_record(&wal_buffer_, job.ts_ms, job.sender, job.recver, job.msg.data(), job.msg.size());
+    add(job.ts_ms, job.sender, job.recver, job.msg.data(), job.msg.size());
+}
+
+// Add the message to the active segment and index it
+void History::add(uint64_t ts_ms, const std::string& sender, const std::string& recver, const char* msg, size_t len) {
+    uint32_t local_ids[2];
+    const std::string* names[2] = {&sender, &recver};
+    for (int i = 0; i < 2; ++i) {
+        auto it = active_name_ids_.emplace(*names[i], active_names_.size()).first;
+        if (it->second == active_names_.size()) {
+            active_names_.push_back(*names[i]);
+        }
+        local_ids[i] = it->second;
+    }
+
+    active_postings_.add(active_.size(), local_ids[0], local_ids[1], msg, len);
+    active_.ts_ms.push_back(ts_ms);
+    active_.sender.push_back(local_ids[0]);
+    active_.recver.push_back(local_ids[1]);
+    active_.msg_data.append(msg, len);
+    active_.msg_offsets.push_back(active_.msg_data.size());
+}
+
+// The posting lists that a row must be in to match the query, from the index of the active or of a sealed segment
+template <typename Index>
+static void get_lists(const Index& index, int kind, uint32_t me, uint32_t peer, const std::vector<std::string>& tokens,
+                      std::vector<HistoryPostingList>* lists) {
+    if (kind == HISTORY_CONVERSATION) {
+        lists->push_back(index.conversation(me, peer));
+    } else {
+        for (const std::string& token : tokens) {
+            lists->push_back(index.keyword(token, me));
+        }
+    }
+}
+
+void History::do_query(const Job& job, HistoryResult* result) {
+    result->clientfd = job.clientfd;
+    result->username = job.username;
+    if (job.limit == 0) {
+        return;
+    }
+    if (job.kind == HISTORY_SEARCH) {
+        tokenize(job.arg.data(), job.arg.size(), &tokens_);
+        if (tokens_.empty()) {
+            return;
+        }
+    } else if (job.kind != HISTORY_CONVERSATION) {
+        fprintf(stderr, "[ERROR] Unknown history query kind %d\n", job.kind);
+        return;
+    }
+
+    // From the active segment back to the oldest one, latest message first. Segments without the users are skipped
+    // before their index files are mapped
+    std::vector<uint64_t> ids;
+    std::vector<HistoryPostingList> lists;
+    for (int64_t seg_idx = segments_.size(); seg_idx >= 0 && ids.size() < job.limit; --seg_idx) {
+        uint32_t me, peer = 0;
+        if (!find_user(seg_idx, job.username, &me) ||
+                (job.kind == HISTORY_CONVERSATION && !find_user(seg_idx, job.arg, &peer))) {
+            continue;
+        }
+        lists.clear();
+        if (seg_idx == (int64_t)segments_.size()) {
+            get_lists(active_postings_, job.kind, me, peer, tokens_, &lists);
+        } else {
+            const HistorySegmentIndex* index = this->index(seg_idx);
+            if (index == nullptr) {
+                continue;
+            }
+            get_lists(*index, job.kind, me, peer, tokens_, &lists);
+        }
+        std::sort(lists.begin(), lists.end(), [](const HistoryPostingList& a, const HistoryPostingList& b) {
+            return a.size() < b.size();
+        });
+
+        // Walk the shortest posting list from the latest row and look up the others
+        uint32_t row;
+        for (size_t i = lists[0].size(); i > 0 && ids.size() < job.limit && lists[0].get(i - 1, &row); --i) {
+            bool match = true;
+            for (size_t j = 1; j < lists.size() && match; ++j) {
+                match = lists[j].contains(row);
+            }
+            if (match) {
+                ids.push_back((uint64_t)seg_idx << 32 | row);
+            }
+        }
+    }
+    std::reverse(ids.begin(), ids.end());
+
+    // Rows whose block cannot be read are left out rather than sent as empty messages
+    result->messages.reserve(ids.size());
+    for (uint64_t id : ids) {
+        result->messages.emplace_back();
+        if (!fetch(id, &result->messages.back())) {
+            result->messages.pop_back();
+        }
+    }
+}
+
+// If the segment cannot be written, it stays active so that no message is lost, and sealing is retried later
+bool History::seal() {
+    std::string path = dir_ + "/" + std::to_string(active_partition_) + "-" + std::to_string(next_file_seq_) + ".seg";
+    std::string index_path = index_path_of(path);
+
+    // The index file is written first, so that a segment file always has one
+    if (!write_file(index_path, active_postings_.encode(active_.size()))) {
+        perror("[ERROR] Failed to write history index");
+        return false;
+    }
+    std::string data = encode_segment(active_, active_names_);
+    if (!write_file(path, data)) {
+        perror("[ERROR] Failed to write history segment");
+        unlink(index_path.c_str());
+        return false;
+    }
+    ++next_file_seq_;
+
+    HistorySegmentMeta meta;
+    meta.path = path;
+    decode_segment_header(data, &meta);
+    segments_.push_back(std::move(meta));
+
+    active_ = HistoryColumns();
+    active_names_.clear();
+    active_name_ids_.clear();
+    active_postings_.clear();
+    // The messages of the log are in the segment now
+    rewrite_wal();
+    return true;
+}
+
+bool History::find_user(uint32_t seg_idx, const std::string& name, uint32_t* user) const {
+    if (seg_idx == segments_.size()) {
+        auto it = active_name_ids_.find(name);
+        if (it == active_name_ids_.end()) {
+            return false;
+        }
+        *user = it->second;
+        return true;
+    }
+    const HistorySegmentMeta& meta = segments_[seg_idx];
+    auto it = std::lower_bound(meta.sorted_names.begin(), meta.sorted_names.end(), name,
+                               [&meta](uint32_t id, const std::string& name) {
+        return meta.names[id] < name;
+    });
+    if (it == meta.sorted_names.end() || meta.names[*it] != name) {
+        return false;
+    }
+    *user = *it;
+    return true;
+}
+
+const HistorySegmentIndex* History::index(uint32_t seg_idx) {
+    auto it = index_cache_.find(seg_idx);
+    if (it != index_cache_.end()) {
+        return it->second.get();
+    }
+
+    const HistorySegmentMeta& meta = segments_[seg_idx];
+    std::shared_ptr<HistorySegmentIndex> index(new HistorySegmentIndex);
+    if (!index->open(index_path_of(meta.path), meta.rows)) {
+        fprintf(stderr, "[ERROR] Failed to open history index: %s\n", index_path_of(meta.path).c_str());
+        // Cache the failure too, so that it is not retried and reported by every query
+        index.reset();
+    }
+
+    const HistorySegmentIndex* res = index.get();
+    index_cache_[seg_idx] = std::move(index);
+    index_cache_order_.push_back(seg_idx);
+    if (index_cache_order_.size() > HISTORY_CACHE_INDEXES) {
+        index_cache_.erase(index_cache_order_.front());
+        index_cache_order_.pop_front();
+    }
+    return res;
+}
+
+const HistoryColumns* History::block(uint32_t seg_idx, uint32_t block_idx) {
+    uint64_t key = (uint64_t)seg_idx << 32 | block_idx;
+    auto it = cache_.find(key);
+    if (it != cache_.end()) {
+        return it->second.get();
+    }
+
+    const HistorySegmentMeta& meta = segments_[seg_idx];
+    uint64_t offset = meta.block_offsets[block_idx];
+    std::string data(meta.block_offsets[block_idx + 1] - offset, '\0');
+    std::shared_ptr<HistoryColumns> cols(new HistoryColumns);
+
+    int fd = open(meta.path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool success = fd >= 0 && pread(fd, &data[0], data.size(), offset) == (ssize_t)data.size() &&
+            decode_block(data.data(), data.data() + data.size(), meta.names.size(), cols.get());
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!success) {
+        fprintf(stderr, "[ERROR] Failed to read block %u of history segment: %s\n", block_idx, meta.path.c_str());
+        // Cache the failure too, so that it is not retried and reported for every row of the block
+        cols.reset();
+    }
+
+    const HistoryColumns* res = cols.get();
+    cache_[key] = std::move(cols);
+    cache_order_.push_back(key);
+    if (cache_order_.size() > HISTORY_CACHE_BLOCKS) {
+        cache_.erase(cache_order_.front());
+        cache_order_.pop_front();
+    }
+    return res;
+}
+
+bool History::fetch(uint64_t id, HistoryMessage* out) {
+    uint32_t seg_idx = id >> 32;
+    uint32_t row = id & 0xffffffff;
+
+    const HistoryColumns* cols;
+    const std::vector<std::string>* names;
+    if (seg_idx == segments_.size()) {
+        cols = &active_;
+        names = &active_names_;
+    } else {
+        // A corrupted index file may point past the rows of the segment
+        if (row >= segments_[seg_idx].rows) {
+            return false;
+        }
+        cols = block(seg_idx, row / HISTORY_BLOCK_ROWS);
+        names = &segments_[seg_idx].names;
+        row %= HISTORY_BLOCK_ROWS;
+    }
+    if (cols == nullptr || row >= cols->size()) {
+        return false;
+    }
+
+    out->ts_ms = cols->ts_ms[row];
+    out->sender = (*names)[cols->sender[row]];
+    out->recver = (*names)[cols->recver[row]];
+    out->msg.assign(cols->msg_data, cols->msg_offsets[row], cols->msg_offsets[row + 1] - cols->msg_offsets[row]);
+    return true;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// A segment is sealed and written to disk when it has this many messages, or when a message of the next time
+// partition arrives. Until then, its messages are kept in the log
+#define HISTORY_SEGMENT_ROWS    65536
+#define HISTORY_PARTITION_MS    3600000
+// Rows of a sealed segment are compressed in independent blocks, so that a message can be read without decoding the
+// whole segment
+#define HISTORY_BLOCK_ROWS      256
+// Number of decoded blocks kept in memory
+#define HISTORY_CACHE_BLOCKS    4096
+// Rows of a posting list in an index file are delta encoded in blocks, so that a row can be looked up by decoding only
+// one block
+#define HISTORY_POSTING_BLOCK   128
+// Number of index files kept mapped
+#define HISTORY_CACHE_INDEXES   64
+// Maximum number of messages returned by a query, whatever the client asks for
+#define HISTORY_MAX_LIMIT       1000
+
+struct HistoryMessage {
+    uint64_t ts_ms;
+    std::string sender, recver, msg;
+};
+
+struct HistoryResult {
+    int clientfd;
+    std::string username;   // the user who sent the query, to detect that clientfd has been reused meanwhile
+    std::vector<HistoryMessage> messages;
+};
+
+// Messages in columnar layout. Users are stored as indices into the dictionary of the segment
+struct HistoryColumns {
+    std::vector<uint64_t> ts_ms;
+    std::vector<uint32_t> sender, recver;
+    std::vector<uint32_t> msg_offsets;  // message i is msg_data[msg_offsets[i], msg_offsets[i + 1])
+    std::string msg_data;
+
+    HistoryColumns() : msg_offsets(1, 0) {}
+
+    inline size_t size() const {
+        return ts_ms.size();
+    }
+};
+
+// Rows of a segment, in ascending order, for a conversation or for a keyword of a user. Either plain rows of the active
+// segment, or rows encoded in an index file, which are decoded one block at a time. The decoded block is kept, so
+// looking up rows in order only decodes each block once. A corrupted list ends at the first invalid row
+class HistoryPostingList {
+ public:
+    HistoryPostingList() : HistoryPostingList(nullptr, 0) {}
+    HistoryPostingList(const uint32_t* rows, size_t size);
+    // The list is encoded at data, and must not go past end. Its rows must be below num_rows
+    HistoryPostingList(const char* data, const char* end, size_t size, uint32_t num_rows);
+
+    inline size_t size() const {
+        return size_;
+    }
+
+    // Returns false if the list is corrupted there
+    bool get(size_t i, uint32_t* row);
+    bool contains(uint32_t row);
+
+ private:
+    bool decode_block(size_t block_idx);
+
+    size_t size_;
+    // Plain rows, if data_ is null
+    const uint32_t* rows_;
+    // Encoded rows
+    const char *data_, *end_;
+    uint32_t num_rows_;
+    size_t num_blocks_;
+    size_t block_idx_;      // the decoded block, or num_blocks_ if none
+    size_t block_size_;     // number of rows decoded successfully
+    uint32_t block_[HISTORY_POSTING_BLOCK];
+};
+
+// Posting lists of the active segment. Users are indices into the dictionary of the segment
+class HistoryPostings {
+ public:
+    void add(uint32_t row, uint32_t sender, uint32_t recver, const char* msg, size_t len);
+    HistoryPostingList conversation(uint32_t a, uint32_t b) const;
+    HistoryPostingList keyword(const std::string& token, uint32_t user) const;
+    // Encode as the index file of a sealed segment with num_rows rows, see HistorySegmentIndex
+    std::string encode(size_t num_rows) const;
+    void clear();
+
+ private:
+    std::unordered_map<std::string, uint32_t> token_ids_;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> conversations_;    // (user << 32 | user) -> rows
+    std::unordered_map<uint64_t, std::vector<uint32_t>> keywords_;         // (user << 32 | token id) -> rows
+    std::vector<std::string> tokens_;
+};
+
+// Posting lists of a sealed segment, looked up in place in the index file next to it. The file is mapped into
+// memory, so only the pages that queries touch are read
+class HistorySegmentIndex {
+ public:
+    HistorySegmentIndex();
+    ~HistorySegmentIndex();
+    HistorySegmentIndex(const HistorySegmentIndex&) = delete;
+    HistorySegmentIndex& operator=(const HistorySegmentIndex&) = delete;
+
+    // Fails if the file is missing or does not match a segment with num_rows rows
+    bool open(const std::string& path, size_t num_rows);
+
+    HistoryPostingList conversation(uint32_t a, uint32_t b) const;
+    HistoryPostingList keyword(const std::string& token, uint32_t user) const;
+
+ private:
+    HistoryPostingList postings(uint32_t begin, uint32_t size) const;
+
+    const char* data_;
+    size_t size_;
+    uint32_t num_rows_, num_conversations_, num_tokens_, num_keywords_, posting_bytes_, token_bytes_;
+    // Tables of the file
+    const char *conversations_, *tokens_, *keywords_, *postings_, *token_data_;
+};
+
+// What is kept in memory for a sealed segment
+struct HistorySegmentMeta {
+    std::string path;
+    size_t rows;
+    std::vector<std::string> names;
+    std::vector<uint32_t> sorted_names;     // indices into names, sorted by name
+    std::vector<uint64_t> block_offsets;    // block i is at [block_offsets[i], block_offsets[i + 1]) of the file
+};
+
+// Server-side message history. Messages are kept in time-partitioned, columnar and compressed segment files under
+// a directory. Each segment file has an index file next to it, written when the segment is sealed, with the rows of
+// each conversation and an inverted index from the keywords to the rows of each user. Queries look up the segments
+// from the latest one until they have enough messages, skipping those without the users, and map only the index files
+// they need. A message id is (segment index << 32 | row).
+// Messages of the segment that is not sealed yet are also appended to a log, which is replayed at startup.
+//
+// All the storage and indexing work runs on a worker thread. The reactor only enqueues jobs, and is notified through
+// eventfd() when query results are ready to be taken.
+class History {
+ public:
+    explicit History(const std::string& dir);
+    ~History();
+
+    inline int eventfd() const {
+        return eventfd_;
+    }
+
+    void append(const std::string& sender, const std::string& recver, const std::string& msg);
+    void query(int clientfd, const std::string& username, int kind, const std::string& arg, size_t limit);
+    // Take the results of finished queries. Should be called when eventfd() is readable
+    std::vector<HistoryResult> take_results();
+
+ private:
+    struct Job {
+        bool is_query;
+        // Appending a message
+        uint64_t ts_ms;
+        std::string sender, recver, msg;
+        // Querying
+        int clientfd, kind;
+        size_t limit;
+        std::string username, arg;
+    };
+
+    void run();
+    void load();
+    void replay_wal();
+    bool rewrite_wal();
+    void flush_wal();
+    void do_append(const Job& job);
+    void add(uint64_t ts_ms, const std::string& sender, const std::string& recver, const char* msg, size_t len);
+    void do_query(const Job& job, HistoryResult* result);
+    bool seal();
+    // The segment at segments_.size() is the active one
+    bool find_user(uint32_t seg_idx, const std::string& name, uint32_t* user) const;
+    const HistorySegmentIndex* index(uint32_t seg_idx);
+    const HistoryColumns* block(uint32_t seg_idx, uint32_t block_idx);
+    bool fetch(uint64_t id, HistoryMessage* out);
+
+    std::string dir_;
+    int eventfd_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Job> jobs_;
+    std::vector<HistoryResult> results_;
+    bool stop_;
+
+    // Everything below is only accessed by the worker thread
+    std::vector<HistorySegmentMeta> segments_;
+    HistoryColumns active_;
+    std::vector<std::string> active_names_;
+    std::unordered_map<std::string, uint32_t> active_name_ids_;
+    uint64_t active_partition_;
+    uint64_t next_file_seq_;
+    int wal_fd_;                // -1 if the log needs to be rewritten from the active segment
+    std::string wal_buffer_;    // records not written into the log yet
+
+    HistoryPostings active_postings_;
+    std::vector<std::string> tokens_;
+
+    // (segment index << 32 | block index) -> decoded block, evicted in the order they are cached
+    std::unordered_map<uint64_t, std::shared_ptr<HistoryColumns>> cache_;
+    std::deque<uint64_t> cache_order_;
+    // Segment index -> mapped index file, evicted in the order they are opened
+    std::unordered_map<uint32_t, std::shared_ptr<HistorySegmentIndex>> index_cache_;
+    std::deque<uint32_t> index_cache_order_;
+
+    std::thread worker_;
+};
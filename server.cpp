@@ -1,16 +1,20 @@
 /*
  * TODO list:
  * The TODO in the code
- * Handle client disconnections
  */
 
 #include "common.h"
+#include "frame.h"
+#include "history.h"
+#include "trace.h"
 
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <signal.h>
 
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -19,6 +23,20 @@
 #define LISTENQ         5
 #define EPOLLEVENTS     100
 
+// Set by SIGUSR2 to dump the trace records at the next iteration of the event loop
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+void handle_sigusr2(int) {
+    trace_dump_requested = 1;
+}
+
+// Set by SIGTERM and SIGINT to leave the event loop, so that the history is sealed before exiting
+static volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop(int) {
+    stop_requested = 1;
+}
+
 int socket_bind(const char* ip_addr, int port) {
     int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
@@ -35,7 +53,7 @@ int socket_bind(const char* ip_addr, int port) {
     return listenfd;
 }
 
-void handle_accpet(int epollfd, int listenfd) {
+void handle_accpet(int epollfd, int listenfd, const LowLatencyConfig& config) {
     struct sockaddr_in addr;
     socklen_t addr_len;
     int clientfd = accept4(listenfd, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK);
@@ -43,22 +61,46 @@ void handle_accpet(int epollfd, int listenfd) {
         perror("[WARN] accept4()");
     }
 
+    set_low_latency_sockopt(clientfd, config);
+
     fprintf(stderr, "[INFO] Accepted new user\n");
 
     add_event(epollfd, clientfd, EPOLLIN);
 }
 
-void handle_register(int epollfd, int clientfd, UsernameFd* username_fd, FdUsername* fd_username, Buffer* buf, FdBlockBuffer* fd_buffer_out) {
-    std::string username = buf->get_string();
+// The connection has been closed by handle_read_common(). Forget about the fd before it is reused, so that frames for
+// the user are kept only in its delivery window until it registers again
+void handle_disconnect(int clientfd, FdBuffer* fd_buffer, UsernameFd* username_fd, FdUsername* fd_username, FdBlockBuffer* fd_buffer_out) {
+    auto it = fd_username->find(clientfd);
+    if (it != fd_username->end()) {
+        // The user may have registered again from another connection
+        auto owner = username_fd->find(it->second);
+        if (owner != username_fd->end() && owner->second == clientfd) {
+            username_fd->erase(owner);
+        }
+        fprintf(stderr, "[INFO] User disconnected: %s\n", it->second.c_str());
+        fd_username->erase(it);
+    }
+    fd_buffer->erase(clientfd);
+    fd_buffer_out->erase(clientfd);
+    if (trace_enabled()) {
+        trace_forget(clientfd);
+    }
+}
+
+void handle_register(int epollfd, int clientfd, UsernameFd* username_fd, FdUsername* fd_username, UsernameWindow* windows, Buffer* buf, FdBlockBuffer* fd_buffer_out) {
+    auto [username] = CSRegister::decode(buf);
 
     if (username.size() > 0) {
         (*username_fd)[username] = clientfd;
         (*fd_username)[clientfd] = username;
 
-        size_t req_len = sizeof(size_t) + sizeof(int);
+        const DeliveryWindow& window = (*windows)[username];
+
         BlockBuffer* buf_out = &fd_buffer_out->emplace(clientfd, -1).first->second;
-        buf_out->write(req_len);
-        buf_out->write(REQ_SC_REGISTER_ACK);
+        SCRegisterAck::encode(buf_out, window.acked_seq());
+        // Resend whatever the user has not acknowledged before its last disconnection
+        window.retransmit(buf_out);
         modify_event(epollfd, clientfd, EPOLLIN | EPOLLOUT);
 
         fprintf(stderr, "[INFO] New user registered: %s\n", username.c_str());
@@ -68,109 +110,196 @@ void handle_register(int epollfd, int clientfd, UsernameFd* username_fd, FdUsern
     }
 }
 
-void handle_msg_send(int epollfd, int senderfd, const UsernameFd& username_fd, const FdUsername& fd_username, Buffer* buf, FdBlockBuffer* fd_buffer_out) {
-    // TODO: reduce copying, probably need string_view?
-    const std::string& sender = fd_username.find(senderfd)->second;
-    size_t sender_size = sender.size();
-    std::string recver = buf->get_string();
-    std::string msg = buf->get_string();
-    size_t msg_size = msg.size();
-    int recverfd = username_fd.find(recver)->second; // TODO: handle non-existing receiver
-
-    size_t req_len = sender_size + msg_size + 3 * sizeof(size_t) + sizeof(int);
-    BlockBuffer* buf_out;
-    bool has_remaining;
+// Assign the next sequence number of the receiver to a new frame, keep it in the delivery window and send it.
+// Return false if the receiver has never registered
+template <typename FrameType>
+bool deliver(int epollfd, uint64_t trace_id, const std::string& sender, const std::string& recver, const std::string& msg, const UsernameFd& username_fd, UsernameWindow* windows, FdBlockBuffer* fd_buffer_out) {
+    // Windows are only created by handle_register(), so that a typo does not keep frames forever
+    auto window_it = windows->find(recver);
+    if (window_it == windows->end()) {
+        fprintf(stderr, "[ERROR] Unknown receiver: %s\n", recver.c_str());
+        return false;
+    }
+    DeliveryWindow* window = &window_it->second;
+    size_t seq = window->next_seq();
+
+    std::string frame;
+    auto recver_it = username_fd.find(recver);
+    // If the receiver is offline, the frame will be sent from the window when it registers again
+    if (recver_it != username_fd.end()) {
+        int recverfd = recver_it->second;
+        BlockBuffer* buf_out;
+        bool has_remaining;
+
+        auto it = fd_buffer_out->find(recverfd);
+        if (it == fd_buffer_out->end()) {
+            buf_out = &fd_buffer_out->emplace(recverfd, -1).first->second;
+            has_remaining = false;
+        } else {
+            buf_out = &it->second;
+            has_remaining = !buf_out->empty();
+        }
+        frame = FrameType::encode_and_copy(buf_out, seq, sender, msg);
+        if (trace_id != 0) {
+            trace_enqueue(trace_id, recverfd, buf_out->total_written());
+        }
 
-    auto it = fd_buffer_out->find(recverfd);
-    if (it == fd_buffer_out->end()) {
-        buf_out = &fd_buffer_out->emplace(recverfd, -1).first->second;
-        has_remaining = false;
+        if (!has_remaining) {
+            // TODO: try writing before polling
+            modify_event(epollfd, recverfd, EPOLLIN | EPOLLOUT);
+        }
     } else {
-        buf_out = &it->second;
-        has_remaining = !buf_out->empty();
+        frame = FrameType::encode_to_string(seq, sender, msg);
     }
-    buf_out->write(req_len);
-    buf_out->write(REQ_SC_NEW_MSG);
-    buf_out->write(sender);
-    buf_out->write(msg);
 
-    if (!has_remaining) {
-        // TODO: try writing before polling
-        modify_event(epollfd, recverfd, EPOLLIN | EPOLLOUT);
+    window->push(seq, std::move(frame));
+    return true;
+}
+
+void handle_msg_send(int epollfd, int senderfd, uint64_t trace_id, const UsernameFd& username_fd, const FdUsername& fd_username, UsernameWindow* windows, History* history, Buffer* buf, FdBlockBuffer* fd_buffer_out) {
+    // TODO: reduce copying, probably need string_view?
+    auto sender_it = fd_username.find(senderfd);
+    if (sender_it == fd_username.end()) {
+        fprintf(stderr, "[ERROR] Message from an unregistered user\n");
+        return;
+    }
+    const std::string& sender = sender_it->second;
+    auto [recver, msg] = CSSendMsg::decode(buf);
+
+    // Files are not kept in the history
+    if (deliver<SCNewMsg>(epollfd, trace_id, sender, recver, msg, username_fd, windows, fd_buffer_out) && history != nullptr) {
+        history->append(sender, recver, msg);
     }
 }
 
 // TODO: need speicial treatments on sending files. Currently using a naive implementation
-void handle_file_send(int epollfd, int senderfd, const UsernameFd& username_fd, const FdUsername& fd_username, Buffer* buf, FdBlockBuffer* fd_buffer_out) {
+void handle_file_send(int epollfd, int senderfd, uint64_t trace_id, const UsernameFd& username_fd, const FdUsername& fd_username, UsernameWindow* windows, Buffer* buf, FdBlockBuffer* fd_buffer_out) {
     // TODO: reduce copying, probably need string_view?
-    const std::string& sender = fd_username.find(senderfd)->second;
-    size_t sender_size = sender.size();
-    std::string recver = buf->get_string();
-    std::string msg = buf->get_string();
-    size_t msg_size = msg.size();
-    int recverfd = username_fd.find(recver)->second; // TODO: handle non-existing receiver
+    auto sender_it = fd_username.find(senderfd);
+    if (sender_it == fd_username.end()) {
+        fprintf(stderr, "[ERROR] File from an unregistered user\n");
+        return;
+    }
+    const std::string& sender = sender_it->second;
+    auto [recver, msg] = CSSendFile::decode(buf);
+
+    deliver<SCNewFile>(epollfd, trace_id, sender, recver, msg, username_fd, windows, fd_buffer_out);
+}
 
-    size_t req_len = sender_size + msg_size + 3 * sizeof(size_t) + sizeof(int);
-    BlockBuffer* buf_out;
-    bool has_remaining;
+// The ack is cumulative: every frame up to and including the sequence number has been received
+void handle_ack(int clientfd, const FdUsername& fd_username, UsernameWindow* windows, Buffer* buf) {
+    auto [seq] = CSAck::decode(buf);
 
-    auto it = fd_buffer_out->find(recverfd);
-    if (it == fd_buffer_out->end()) {
-        buf_out = &fd_buffer_out->emplace(recverfd, -1).first->second;
-        has_remaining = false;
-    } else {
-        buf_out = &it->second;
-        has_remaining = !buf_out->empty();
+    auto it = fd_username.find(clientfd);
+    if (it == fd_username.end()) {
+        fprintf(stderr, "[ERROR] Ack from an unregistered user\n");
+        return;
+    }
+    (*windows)[it->second].ack(seq);
+}
+
+void handle_query_history(int epollfd, int clientfd, const FdUsername& fd_username, History* history, Buffer* buf, FdBlockBuffer* fd_buffer_out) {
+    auto [kind, arg, limit] = CSQueryHistory::decode(buf);
+
+    auto it = fd_username.find(clientfd);
+    if (it == fd_username.end()) {
+        fprintf(stderr, "[ERROR] History query from an unregistered user\n");
+        return;
+    }
+
+    // The result is sent by handle_history_results() when it is ready
+    if (history != nullptr) {
+        history->query(clientfd, it->second, kind, arg, limit);
+        return;
     }
-    buf_out->write(req_len);
-    buf_out->write(REQ_SC_NEW_FILE);
-    buf_out->write(sender);
-    buf_out->write(msg);
 
+    BlockBuffer* buf_out = &fd_buffer_out->emplace(clientfd, -1).first->second;
+    bool has_remaining = !buf_out->empty();
+    SCHistoryEnd::encode(buf_out, (size_t)0);
     if (!has_remaining) {
-        // TODO: try writing before polling
-        modify_event(epollfd, recverfd, EPOLLIN | EPOLLOUT);
+        modify_event(epollfd, clientfd, EPOLLIN | EPOLLOUT);
+    }
+}
+
+void handle_history_results(int epollfd, const FdUsername& fd_username, History* history, FdBlockBuffer* fd_buffer_out) {
+    for (const HistoryResult& result : history->take_results()) {
+        // The user has disconnected and the fd may have been reused
+        auto it = fd_username.find(result.clientfd);
+        if (it == fd_username.end() || it->second != result.username) {
+            continue;
+        }
+
+        BlockBuffer* buf_out = &fd_buffer_out->emplace(result.clientfd, -1).first->second;
+        bool has_remaining = !buf_out->empty();
+        for (const HistoryMessage& msg : result.messages) {
+            SCHistoryMsg::encode(buf_out, (size_t)msg.ts_ms, msg.sender, msg.recver, msg.msg);
+        }
+        SCHistoryEnd::encode(buf_out, result.messages.size());
+        if (!has_remaining) {
+            modify_event(epollfd, result.clientfd, EPOLLIN | EPOLLOUT);
+        }
     }
 }
 
 // TODO: Should I put all requests into one single buffer?
-void handle_read(int epollfd, int clientfd, FdBuffer* fd_buffer, UsernameFd* username_fd, FdUsername* fd_username, FdBlockBuffer* fd_buffer_out) {
+void handle_read(int epollfd, int clientfd, FdBuffer* fd_buffer, UsernameFd* username_fd, FdUsername* fd_username, UsernameWindow* windows, History* history, FdBlockBuffer* fd_buffer_out) {
     // Get the corresponding buffer
     auto it = fd_buffer->find(clientfd);
     // If the buffer does not exist, create one
     if (it == fd_buffer->end()) {
         it = fd_buffer->emplace(clientfd, sizeof(size_t)).first;
+        if (trace_enabled()) {
+            trace_frame_begin(clientfd);
+        }
     }
 
     Buffer* buf = &it->second;
 
     // Read the request. If we have finished reading the request, process it
-    if (handle_read_common(clientfd, buf)) {
+    bool closed = false;
+    if (handle_read_common(clientfd, buf, &closed)) {
+        uint64_t trace_id = trace_enabled() ? trace_frame_end(clientfd) : 0;
         buf->inc_rpos(sizeof(size_t));
         const int* req_type = buf->read<int>();
 
         switch (*req_type) {
             case REQ_CS_REGISTER:
-                handle_register(epollfd, clientfd, username_fd, fd_username, buf, fd_buffer_out);
+                handle_register(epollfd, clientfd, username_fd, fd_username, windows, buf, fd_buffer_out);
                 break;
             case REQ_CS_SEND_MSG:
-                handle_msg_send(epollfd, clientfd, *username_fd, *fd_username, buf, fd_buffer_out);
+                handle_msg_send(epollfd, clientfd, trace_id, *username_fd, *fd_username, windows, history, buf, fd_buffer_out);
                 break;
             case REQ_CS_SEND_FILE:
-                handle_file_send(epollfd, clientfd, *username_fd, *fd_username, buf, fd_buffer_out);
+                handle_file_send(epollfd, clientfd, trace_id, *username_fd, *fd_username, windows, buf, fd_buffer_out);
+                break;
+            case REQ_CS_ACK:
+                handle_ack(clientfd, *fd_username, windows, buf);
+                break;
+            case REQ_CS_QUERY_HISTORY:
+                handle_query_history(epollfd, clientfd, *fd_username, history, buf, fd_buffer_out);
                 break;
         }
 
         fd_buffer->erase(it);
+    } else if (closed) {
+        handle_disconnect(clientfd, fd_buffer, username_fd, fd_username, fd_buffer_out);
     }
 }
 
 void handle_write(int epollfd, int recverfd, FdBlockBuffer* fd_buffer_out) {
-    BlockBuffer* buf_out = &fd_buffer_out->find(recverfd)->second;
+    auto it = fd_buffer_out->find(recverfd);
+    // The connection has been closed while handling EPOLLIN of the same event
+    if (it == fd_buffer_out->end()) {
+        return;
+    }
+    BlockBuffer* buf_out = &it->second;
 
     if (buf_out->output_to_fd(recverfd) < 0) {
         return;
     }
+    if (trace_enabled()) {
+        trace_flush(recverfd, buf_out->total_flushed());
+    }
  
     // TODO: If we use edge trigger, we can avoid modifying the event frequently
     if (buf_out->empty()) {
@@ -180,10 +309,38 @@ void handle_write(int epollfd, int recverfd, FdBlockBuffer* fd_buffer_out) {
 }
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        printf("Usage: ./server <ip_addr> <port>\n");
+    LowLatencyConfig config;
+    std::string history_dir;
+    bool valid_args = argc >= 3;
+    for (int i = 3; i < argc; ++i) {
+        // Trace one out of every n messages. Send SIGUSR2 to dump the trace into trace-<pid>.json
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            char* end;
+            long rate = strtol(argv[i] + 8, &end, 10);
+            if (end == argv[i] + 8 || *end != '\0' || rate < 0 || rate > UINT_MAX) {
+                fprintf(stderr, "[ERROR] Invalid trace sample rate: %s\n", argv[i] + 8);
+                valid_args = false;
+            } else {
+                trace_sample_rate = rate;
+            }
+        // Keep the message history in the directory
+        } else if (strncmp(argv[i], "--history=", 10) == 0) {
+            history_dir = argv[i] + 10;
+        } else {
+            valid_args &= parse_low_latency_arg(argv[i], &config);
+        }
+    }
+    if (!valid_args) {
+        printf("Usage: ./server <ip_addr> <port> [--low-latency[=<busy_poll_us>]] [--cpu=<n>] [--trace=<n>] [--history=<dir>]\n");
+        return 1;
     }
 
+    signal(SIGUSR2, handle_sigusr2);
+    signal(SIGTERM, handle_stop);
+    signal(SIGINT, handle_stop);
+    // Writing to a disconnected user should not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     int listenfd = socket_bind(argv[1], atoi(argv[2]));
     listen(listenfd, LISTENQ);
 
@@ -191,25 +348,47 @@ int main(int argc, char** argv) {
     add_event(epollfd, listenfd, EPOLLIN);
 
     struct epoll_event events[EPOLLEVENTS];
+    BusyPoller poller(epollfd, config);
 
     UsernameFd username_fd;
     FdUsername fd_username;
     FdBuffer fd_buffer;
     FdBlockBuffer fd_buffer_out;
+    UsernameWindow windows;
+
+    std::unique_ptr<History> history;
+    int history_fd = -1;
+    if (!history_dir.empty()) {
+        history.reset(new History(history_dir));
+        history_fd = history->eventfd();
+        add_event(epollfd, history_fd, EPOLLIN);
+    }
+    // After starting the history worker, which would otherwise inherit the CPU and compete with the event loop
+    pin_to_cpu(config);
 
-    for (;;) {
-        int num = epoll_wait(epollfd, events, EPOLLEVENTS, -1);
+    while (!stop_requested) {
+        int num = poller.wait(events, EPOLLEVENTS, -1);
+
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            std::string path = "trace-" + std::to_string(getpid()) + ".json";
+            if (!trace_dump_async(path)) {
+                fprintf(stderr, "[WARN] The previous trace dump is still running\n");
+            }
+        }
 
         for (int i = 0; i < num; ++i) {
             int fd = events[i].data.fd;
 
             if (fd == listenfd) {
                 if (events[i].events & EPOLLIN) {
-                    handle_accpet(epollfd, listenfd);
+                    handle_accpet(epollfd, listenfd, config);
                 }
+            } else if (fd == history_fd) {
+                handle_history_results(epollfd, fd_username, history.get(), &fd_buffer_out);
             } else {
                 if (events[i].events & EPOLLIN) {
-                    handle_read(epollfd, fd, &fd_buffer, &username_fd, &fd_username, &fd_buffer_out);
+                    handle_read(epollfd, fd, &fd_buffer, &username_fd, &fd_username, &windows, history.get(), &fd_buffer_out);
                 }
 
                 if (events[i].events & EPOLLOUT) {
@@ -218,5 +397,9 @@ int main(int argc, char** argv) {
             }
         }
     }
+
+    fprintf(stderr, "[INFO] Shutting down\n");
+    // Seal the active segment of the history
+    history.reset();
 }
 
@@ -0,0 +1,182 @@
+#include "trace.h"
+#include "common.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+unsigned trace_sample_rate = 0;
+
+// Rings are never freed, so that the records of exited threads can still be dumped. Neither is the list, so that a dump
+// still running on its detached thread at exit does not see it destroyed
+static std::mutex rings_mutex;
+static std::vector<TraceRing*>& rings = *new std::vector<TraceRing*>;
+
+static std::atomic<uint64_t> next_trace_id(1);
+
+static std::atomic<bool> dumping(false);
+
+struct ThreadTraceState {
+    ThreadTraceState() : ring(new TraceRing), num_frames(0) {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        rings.push_back(ring);
+    }
+
+    TraceRing* ring;
+    size_t num_frames;
+    // fd -> id of the sampled frame being read from it
+    std::unordered_map<int, uint64_t> reading;
+    // fd -> (end position in the output stream, id) of the sampled frames not yet written into it
+    std::unordered_map<int, std::deque<std::pair<size_t, uint64_t>>> writing;
+};
+
+static thread_local ThreadTraceState state;
+
+size_t TraceRing::snapshot(TraceRecord* out) const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (size_t i = begin; i < head; ++i) {
+        const Slot& slot = slots_[i & (TRACE_RING_SIZE - 1)];
+        out[i - begin] = TraceRecord{slot.id.load(std::memory_order_relaxed), slot.ts_ns.load(std::memory_order_relaxed),
+                                     slot.stage.load(std::memory_order_relaxed), slot.fd.load(std::memory_order_relaxed)};
+    }
+
+    // Discard the records that the writer may have overwritten while we were copying. The fence keeps the copying above
+    // from being reordered after loading the new head, and pairs with the fence in push()
+    std::atomic_thread_fence(std::memory_order_acquire);
+    size_t new_head = head_.load(std::memory_order_relaxed);
+    size_t valid_begin = new_head + 1 > TRACE_RING_SIZE ? new_head + 1 - TRACE_RING_SIZE : 0;
+    if (valid_begin <= begin) {
+        return head - begin;
+    } else if (valid_begin >= head) {
+        return 0;
+    }
+    std::copy(out + (valid_begin - begin), out + (head - begin), out);
+    return head - valid_begin;
+}
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_record(uint64_t id, int stage, int fd) {
+    state.ring->push(TraceRecord{id, trace_now(), stage, fd});
+}
+
+void trace_frame_begin(int fd) {
+    if (++state.num_frames % trace_sample_rate != 0) {
+        return;
+    }
+
+    uint64_t id = next_trace_id.fetch_add(1, std::memory_order_relaxed);
+    state.reading[fd] = id;
+    trace_record(id, TRACE_READ, fd);
+}
+
+uint64_t trace_frame_end(int fd) {
+    auto it = state.reading.find(fd);
+    if (it == state.reading.end()) {
+        return 0;
+    }
+
+    uint64_t id = it->second;
+    state.reading.erase(it);
+    trace_record(id, TRACE_FRAME, fd);
+    return id;
+}
+
+void trace_enqueue(uint64_t id, int fd, size_t end_pos) {
+    trace_record(id, TRACE_ENQUEUE, fd);
+    state.writing[fd].emplace_back(end_pos, id);
+}
+
+void trace_flush(int fd, size_t read_pos) {
+    auto it = state.writing.find(fd);
+    if (it == state.writing.end()) {
+        return;
+    }
+
+    std::deque<std::pair<size_t, uint64_t>>* pending = &it->second;
+    while (!pending->empty() && pending->front().first <= read_pos) {
+        trace_record(pending->front().second, TRACE_FLUSH, fd);
+        pending->pop_front();
+    }
+    if (pending->empty()) {
+        state.writing.erase(it);
+    }
+}
+
+void trace_forget(int fd) {
+    state.reading.erase(fd);
+    state.writing.erase(fd);
+}
+
+// Each message is shown as a row of the timeline, with one slice for the time spent before each stage
+bool trace_dump(const char* path) {
+    static const char* const slice_names[] = {"", "read", "dispatch", "queue"};
+
+    std::vector<TraceRecord> records;
+    std::unique_ptr<TraceRecord[]> snapshot(new TraceRecord[TRACE_RING_SIZE]);
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (const TraceRing* ring : rings) {
+            size_t num = ring->snapshot(snapshot.get());
+            records.insert(records.end(), snapshot.get(), snapshot.get() + num);
+        }
+    }
+
+    std::sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a.id < b.id || (a.id == b.id && a.ts_ns < b.ts_ns);
+    });
+
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    int pid = getpid();
+    bool first = true;
+    fprintf(fp, "{\"traceEvents\":[");
+    for (size_t i = 1; i < records.size(); ++i) {
+        const TraceRecord& prev = records[i - 1];
+        const TraceRecord& cur = records[i];
+        if (prev.id != cur.id || cur.stage <= prev.stage) {
+            continue;
+        }
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"fd\":%d}}",
+                first ? "" : ",", slice_names[cur.stage], pid, (unsigned long long)cur.id,
+                prev.ts_ns / 1000.0, (cur.ts_ns - prev.ts_ns) / 1000.0, cur.fd);
+        first = false;
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    return fclose(fp) == 0;
+}
+
+bool trace_dump_async(const std::string& path) {
+    if (dumping.exchange(true)) {
+        return false;
+    }
+
+    std::thread([path]() {
+        // Do not compete with the event loop for its CPU
+        unpin_from_cpu();
+        if (trace_dump(path.c_str())) {
+            fprintf(stderr, "[INFO] Trace dumped to %s\n", path.c_str());
+        } else {
+            perror("[ERROR] trace_dump()");
+        }
+        dumping.store(false);
+    }).detach();
+    return true;
+}
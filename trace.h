@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Stages of a traced message on the server
+#define TRACE_READ              0   // started reading the frame from the sender's socket
+#define TRACE_FRAME             1   // the whole frame has been read
+#define TRACE_ENQUEUE           2   // the frame to the receiver has been written into its BlockBuffer
+#define TRACE_FLUSH             3   // the frame to the receiver has been written into its socket
+
+// Number of records kept per thread. Must be a power of 2
+#define TRACE_RING_SIZE         65536
+
+struct TraceRecord {
+    uint64_t id;
+    uint64_t ts_ns;
+    int stage;
+    int fd;
+};
+
+// Ring buffer of trace records written by only one thread. The oldest records are overwritten when it is full.
+// Other threads can take a snapshot without locking. It is a seqlock: the fields are relaxed atomics so that a snapshot
+// racing with push() is not a data race, and records that may have been overwritten meanwhile are discarded.
+class TraceRing {
+ public:
+    TraceRing() : slots_(new Slot[TRACE_RING_SIZE]), head_(0) {}
+
+    inline void push(const TraceRecord& record) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        Slot* slot = &slots_[head & (TRACE_RING_SIZE - 1)];
+        // Pairs with the fence in snapshot(): a reader that sees any of the stores below also sees at least this head
+        std::atomic_thread_fence(std::memory_order_release);
+        slot->id.store(record.id, std::memory_order_relaxed);
+        slot->ts_ns.store(record.ts_ns, std::memory_order_relaxed);
+        slot->stage.store(record.stage, std::memory_order_relaxed);
+        slot->fd.store(record.fd, std::memory_order_relaxed);
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Copy the records into out, which should have space for TRACE_RING_SIZE records. Returns the number of records
+    size_t snapshot(TraceRecord* out) const;
+
+ private:
+    struct Slot {
+        std::atomic<uint64_t> id;
+        std::atomic<uint64_t> ts_ns;
+        std::atomic<int> stage;
+        std::atomic<int> fd;
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<size_t> head_;
+};
+
+// Trace one out of every trace_sample_rate frames. 0 disables tracing
+extern unsigned trace_sample_rate;
+
+inline bool trace_enabled() {
+    return trace_sample_rate != 0;
+}
+
+uint64_t trace_now();
+void trace_record(uint64_t id, int stage, int fd);
+
+// Called before reading the first bytes of a frame from fd. Decides whether the frame is sampled
+void trace_frame_begin(int fd);
+// Called when the whole frame has been read from fd. Returns the trace id of the frame, or 0 if it is not sampled
+uint64_t trace_frame_end(int fd);
+// The frame has been written into the BlockBuffer of fd, and it ends at byte end_pos of the whole output stream
+void trace_enqueue(uint64_t id, int fd, size_t end_pos);
+// Bytes before read_pos of the output stream of fd have been written into the socket
+void trace_flush(int fd, size_t read_pos);
+// fd has been closed and reused. Drop the frames that are still pending on it
+void trace_forget(int fd);
+
+// Write the records of all threads into path as Chrome trace-event JSON. Returns false on failure
+bool trace_dump(const char* path);
+// Run trace_dump() on a new thread, so that the calling event loop is not stalled by writing the records. The result
+// is logged. Returns false if a previous dump is still running
+bool trace_dump_async(const std::string& path);